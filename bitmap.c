@@ -1,13 +1,16 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "bitmap.h"
 
+const int BITS_PER_GROUP = 8 * sizeof(uint8_t);
+
 int bitmap_get(void* bm, int ii) {
     assert(ii >= 0);
-    int groupIdx = ii / sizeof(uint8_t);
-    int bitIdx = ii % sizeof(uint8_t);
+    int groupIdx = ii / BITS_PER_GROUP;
+    int bitIdx = ii % BITS_PER_GROUP;
     uint8_t mask = 1 << bitIdx;
 
     return (((uint8_t*)bm)[groupIdx] & mask) >> bitIdx;
@@ -16,8 +19,8 @@ int bitmap_get(void* bm, int ii) {
 void bitmap_put(void* bm, int ii, int vv) {
     assert(vv == 1 || vv == 0);
     assert(ii >= 0);
-    int groupIdx = ii / sizeof(uint8_t);
-    int bitIdx = ii % sizeof(uint8_t);
+    int groupIdx = ii / BITS_PER_GROUP;
+    int bitIdx = ii % BITS_PER_GROUP;
     uint8_t mask = 1 << bitIdx;
 
     if (vv == 0) {
@@ -28,10 +31,31 @@ void bitmap_put(void* bm, int ii, int vv) {
     }
 }
 
+void bitmap_clear_range(void* bm, int start, int count) {
+    assert(start >= 0 && count >= 0);
+    uint8_t* map = (uint8_t*)bm;
+    int end = start + count;
+
+    // Leading bits up to a group boundary
+    while (start < end && start % BITS_PER_GROUP != 0) {
+        bitmap_put(bm, start++, 0);
+    }
+
+    // Whole groups in one go
+    int groups = (end - start) / BITS_PER_GROUP;
+    memset(map + start / BITS_PER_GROUP, 0, groups);
+    start += groups * BITS_PER_GROUP;
+
+    // Trailing bits
+    while (start < end) {
+        bitmap_put(bm, start++, 0);
+    }
+}
+
 void bitmap_print(void* bm, int size) {
-    assert(size % sizeof(uint8_t) == 0);
+    assert(size % BITS_PER_GROUP == 0);
     uint8_t* map = (uint8_t*)bm;
-    for (uint8_t* ii = map; ii < map + size / sizeof(uint8_t); ii++) {
-        printf("%d\n", *map);
+    for (uint8_t* ii = map; ii < map + size / BITS_PER_GROUP; ii++) {
+        printf("%d\n", *ii);
     }
 }
\ No newline at end of file
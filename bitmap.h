@@ -21,6 +21,15 @@ int bitmap_get(void* bm, int ii);
  */
 void bitmap_put(void* bm, int ii, int vv);
 
+/**
+ * @brief Clears a range of bits, whole bytes at a time where possible.
+ * 
+ * @param bm the beginning of the bitmap
+ * @param start the index of the first bit
+ * @param count the number of bits to clear
+ */
+void bitmap_clear_range(void* bm, int start, int count);
+
 /**
  * @brief Prints a bitmap.
  * 
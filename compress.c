@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <lz4.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pages.h"
+#include "util.h"
+
+#include "compress.h"
+
+#define CLUSTER_SIZE (COMPRESS_CLUSTER_PAGES * PAGE_SIZE)
+#define CACHE_SLOTS 16
+
+// A compressed file's pages hold a stream starting with this header, followed by
+// each cluster's bytes. A cluster stored at its raw length was incompressible.
+typedef struct stream_header {
+  uint32_t count; // number of clusters
+  uint32_t ends[]; // end of each cluster's bytes, relative to the end of the header
+} stream_header;
+
+typedef struct cached_cluster {
+  int inum; // -1 if the slot is empty
+  int cluster;
+  char* data; // CLUSTER_SIZE bytes
+} cached_cluster;
+
+static cached_cluster* cache = 0;
+static char* packedScratch = 0; // a compressed cluster on its way into the cache, CLUSTER_SIZE bytes
+static compress_stats stats;
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Copies bytes between a buffer and a file's pages, ignoring the file's size
+static void stream_copy(inode* node, char* buf, size_t size, off_t offset, int toFile) {
+  while (size > 0) {
+    int* slot = inode_page_slot(node, offset / PAGE_SIZE);
+    char* page = (char*)pages_get_page(*slot) + offset % PAGE_SIZE;
+    int chunk = min(size, PAGE_SIZE - offset % PAGE_SIZE);
+
+    if (toFile) {
+      memcpy(page, buf, chunk);
+    } else {
+      memcpy(buf, page, chunk);
+    }
+
+    buf += chunk;
+    offset += chunk;
+    size -= chunk;
+  }
+}
+
+void compress_forget(int inum) {
+  for (int ii = 0; cache != 0 && ii < CACHE_SLOTS; ii++) {
+    if (cache[ii].inum == inum) {
+      cache[ii].inum = -1;
+    }
+  }
+}
+
+static int cluster_raw_size(inode* node, int cluster) {
+  return min(CLUSTER_SIZE, node->size - cluster * CLUSTER_SIZE);
+}
+
+int compress_file(int inum) {
+  inode* node = get_inode(inum);
+
+  if ((node->flags & INODE_COMPRESSED) || node->size <= PAGE_SIZE) {
+    return 0;
+  }
+
+  int64_t start = now_ns();
+  int count = (node->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  int headerSize = sizeof(stream_header) + count * sizeof(uint32_t);
+  char* raw = malloc(node->size);
+  char* out = malloc(headerSize + count * LZ4_compressBound(CLUSTER_SIZE));
+  if (raw == 0 || out == 0) {
+    free(raw);
+    free(out);
+    return -ENOMEM;
+  }
+
+  stream_copy(node, raw, node->size, 0, 0);
+
+  stream_header* header = (stream_header*)out;
+  header->count = count;
+  int streamSize = 0;
+  int rawClusters = 0;
+
+  for (int ii = 0; ii < count; ii++) {
+    int rawSize = cluster_raw_size(node, ii);
+    char* src = raw + ii * CLUSTER_SIZE;
+    char* dst = out + headerSize + streamSize;
+
+    // Anything that doesn't come out smaller is kept raw
+    int packed = LZ4_compress_default(src, dst, rawSize, rawSize - 1);
+    if (packed <= 0) {
+      memcpy(dst, src, rawSize);
+      packed = rawSize;
+      rawClusters++;
+    }
+
+    streamSize += packed;
+    header->ends[ii] = streamSize;
+  }
+
+  int rawSize = node->size;
+  int total = headerSize + streamSize;
+
+  int tmpIdx = -1;
+  if (bytes_to_pages(total) < bytes_to_pages(rawSize)) {
+    tmpIdx = alloc_inode();
+  }
+
+  // Build the stream in a scratch inode so running out of space leaves the file as it was
+  inode* tmp = tmpIdx < 0 ? 0 : get_inode(tmpIdx);
+  if (tmp != 0 && grow_inode(tmp, total) == 0) {
+    stream_copy(tmp, out, total, 0, 1);
+
+    // Swap the raw pages for the stream, keeping the logical size for stat
+    shrink_inode(node, 0);
+    memcpy(node->ptrs, tmp->ptrs, sizeof(node->ptrs));
+    node->iptr = tmp->iptr;
+    node->size = rawSize;
+    node->flags |= INODE_COMPRESSED;
+    memset(tmp->ptrs, 0, sizeof(tmp->ptrs));
+    tmp->iptr = 0;
+    compress_forget(inum);
+
+    stats.files_compressed++;
+    stats.clusters_raw += rawClusters;
+    stats.bytes_in += rawSize;
+    stats.bytes_out += total;
+    printf("+ compress_file(%d) -> %d bytes in %d\n", inum, rawSize, total);
+  } else {
+    stats.files_skipped++;
+  }
+
+  if (tmpIdx >= 0) {
+    free_inode(tmpIdx);
+  }
+
+  stats.compress_ns += now_ns() - start;
+  free(raw);
+  free(out);
+  return 0;
+}
+
+int compress_inflate(int inum) {
+  inode* node = get_inode(inum);
+
+  if (!(node->flags & INODE_COMPRESSED)) {
+    return 0;
+  }
+
+  int rawSize = node->size;
+  char* raw = malloc(rawSize);
+  if (raw == 0) {
+    return -ENOMEM;
+  }
+
+  int rv = compress_read(inum, raw, rawSize, 0);
+  if (rv < 0) {
+    free(raw);
+    return rv;
+  }
+
+  // Like compress_file, the raw copy is built aside so running out of space
+  // leaves the compressed data where it was
+  int tmpIdx = alloc_inode();
+  if (tmpIdx < 0) {
+    free(raw);
+    return -ENOSPC;
+  }
+
+  inode* tmp = get_inode(tmpIdx);
+  rv = grow_inode(tmp, rawSize);
+  if (rv == 0) {
+    stream_copy(tmp, raw, rawSize, 0, 1);
+
+    shrink_inode(node, 0);
+    memcpy(node->ptrs, tmp->ptrs, sizeof(node->ptrs));
+    node->iptr = tmp->iptr;
+    node->size = rawSize;
+    node->flags &= ~INODE_COMPRESSED;
+    memset(tmp->ptrs, 0, sizeof(tmp->ptrs));
+    tmp->iptr = 0;
+    compress_forget(inum);
+  }
+
+  free_inode(tmpIdx);
+  free(raw);
+  printf("+ compress_inflate(%d) -> %d\n", inum, rv);
+  return rv;
+}
+
+// Finds or fills the cache slot holding a decompressed cluster
+static cached_cluster* cache_get(int inum, inode* node, int cluster) {
+  if (cache == 0) {
+    cache = malloc(CACHE_SLOTS * sizeof(cached_cluster));
+    for (int ii = 0; ii < CACHE_SLOTS; ii++) {
+      cache[ii].inum = -1;
+      cache[ii].data = malloc(CLUSTER_SIZE);
+    }
+    packedScratch = malloc(CLUSTER_SIZE);
+  }
+
+  cached_cluster* entry = &cache[(inum * 31 + cluster) % CACHE_SLOTS];
+  if (entry->inum == inum && entry->cluster == cluster) {
+    stats.cache_hits++;
+    return entry;
+  }
+
+  int64_t start = now_ns();
+  stats.cache_misses++;
+
+  uint32_t count;
+  stream_copy(node, (char*)&count, sizeof(count), 0, 0);
+  if (cluster >= count) {
+    return 0;
+  }
+
+  uint32_t ends[2] = { 0, 0 };
+  off_t headerSize = sizeof(stream_header) + count * sizeof(uint32_t);
+  if (cluster == 0) {
+    stream_copy(node, (char*)&ends[1], sizeof(uint32_t), sizeof(stream_header), 0);
+  } else {
+    stream_copy(node, (char*)ends, 2 * sizeof(uint32_t),
+                sizeof(stream_header) + (cluster - 1) * sizeof(uint32_t), 0);
+  }
+
+  int packedSize = ends[1] - ends[0];
+  int rawSize = cluster_raw_size(node, cluster);
+  if (packedSize <= 0 || packedSize > rawSize) {
+    return 0;
+  }
+
+  entry->inum = -1;
+  if (packedSize == rawSize) {
+    stream_copy(node, entry->data, rawSize, headerSize + ends[0], 0);
+  } else {
+    stream_copy(node, packedScratch, packedSize, headerSize + ends[0], 0);
+    if (LZ4_decompress_safe(packedScratch, entry->data, packedSize, CLUSTER_SIZE) != rawSize) {
+      return 0;
+    }
+  }
+
+  entry->inum = inum;
+  entry->cluster = cluster;
+  stats.decompress_ns += now_ns() - start;
+  return entry;
+}
+
+// Reads a word of the stream, or fails if the chain doesn't lead to a data page for it
+static int stream_peek(inode* node, off_t offset, uint32_t* word) {
+  int pageIdx = offset / PAGE_SIZE;
+  while (pageIdx >= 5 && node != 0) {
+    node = node->iptr != 0 ? get_inode(node->iptr) : 0;
+    pageIdx -= 5;
+  }
+
+  int pnum = node != 0 ? node->ptrs[pageIdx] : 0;
+  if (pnum < get_superblock()->first_data_page || pnum >= PAGE_COUNT) {
+    return -EIO;
+  }
+
+  memcpy(word, (char*)pages_get_page(pnum) + offset % PAGE_SIZE, sizeof(uint32_t));
+  return 0;
+}
+
+int compress_stream_size(inode* node) {
+  uint32_t count = (node->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+  off_t headerSize = sizeof(stream_header) + count * sizeof(uint32_t);
+  uint32_t stored;
+  uint32_t end;
+
+  if (count == 0 || stream_peek(node, 0, &stored) != 0 || stored != count ||
+      stream_peek(node, headerSize - sizeof(uint32_t), &end) != 0 ||
+      end > count * CLUSTER_SIZE) {
+    return -EIO;
+  }
+
+  return headerSize + end;
+}
+
+int compress_read(int inum, char* buf, size_t size, off_t offset) {
+  inode* node = get_inode(inum);
+  size_t done = 0;
+
+  while (done < size) {
+    int cluster = (offset + done) / CLUSTER_SIZE;
+    int within = (offset + done) % CLUSTER_SIZE;
+    cached_cluster* entry = cache_get(inum, node, cluster);
+    if (entry == 0) {
+      return -EIO;
+    }
+
+    int chunk = min(size - done, cluster_raw_size(node, cluster) - within);
+    memcpy(buf + done, entry->data + within, chunk);
+    done += chunk;
+  }
+
+  return size;
+}
+
+compress_stats compress_get_stats() {
+  return stats;
+}
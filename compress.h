@@ -0,0 +1,76 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "inode.h"
+
+#define COMPRESS_CLUSTER_PAGES 4 // pages compressed together as one unit
+
+typedef struct compress_stats {
+    int64_t files_compressed; // files stored compressed on flush
+    int64_t files_skipped; // files left raw because they didn't shrink
+    int64_t clusters_raw; // incompressible clusters stored as-is
+    int64_t bytes_in; // raw bytes of compressed files
+    int64_t bytes_out; // bytes those files take up compressed
+    int64_t compress_ns; // time spent compressing
+    int64_t decompress_ns; // time spent decompressing on cache misses
+    int64_t cache_hits; // cluster reads served from the cache
+    int64_t cache_misses; // cluster reads that had to decompress
+} compress_stats;
+
+/**
+ * @brief Stores a file's data compressed if that takes fewer pages.
+ * 
+ * @param inum the index of the file's inode
+ * @return int 0 if successful (compressed or not), ENOMEM if out of memory
+ */
+int compress_file(int inum);
+
+/**
+ * @brief Stores a compressed file's data raw again so it can be modified in place.
+ * 
+ * @param inum the index of the file's inode
+ * @return int 0 if successful, ENOSPC if out of pages, ENOMEM if out of memory
+ */
+int compress_inflate(int inum);
+
+/**
+ * @brief Drops any decompressed clusters cached for an inode, which has to be
+ *        done whenever its pages are replaced or the inode is reused.
+ * 
+ * @param inum the index of the inode
+ */
+void compress_forget(int inum);
+
+/**
+ * @brief Reads from a compressed file through the decompressed cluster cache.
+ * 
+ * @param inum the index of the file's inode
+ * @param buf where to put the data
+ * @param size the number of bytes to read, must be within the file
+ * @param offset where to start reading
+ * @return int the number of bytes read, EIO if the data is corrupt
+ */
+int compress_read(int inum, char* buf, size_t size, off_t offset);
+
+/**
+ * @brief Works out how many bytes of a compressed file's pages its stream takes
+ *        up, from the stream's header. Only looks at pages the chain actually
+ *        points at, so it's safe on a damaged image.
+ * 
+ * @param node the file's inode
+ * @return int the size of the stream, EIO if the header is missing or doesn't
+ *         match the file's size
+ */
+int compress_stream_size(inode* node);
+
+/**
+ * @brief Gets the compression counters.
+ * 
+ * @return compress_stats the totals since mount
+ */
+compress_stats compress_get_stats();
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "pages.h"
+#include "util.h"
+
+#include "dedup.h"
+
+#define FORGOTTEN -1 // a slot whose page was freed, skipped but kept for probing
+
+typedef struct fingerprint {
+  uint64_t hash;
+  int pnum; // 0 marks an empty slot
+  int owner; // the inode whose direct pages held pnum when it was indexed
+} fingerprint;
+
+// Maps page hashes to a page with that content. Freed pages are dropped from it,
+// but pages are also rewritten in place, so every hit is verified before it is
+// shared: it must still be a data page of its owner, and have the same bytes.
+static fingerprint* fingerprints = 0;
+static int* slotOf = 0; // the slot indexing each page, -1 if none
+static int fingerprintsSize = 0;
+static int fingerprintsUsed = 0;
+
+static dedup_stats totals;
+
+static int64_t cpu_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fingerprints_reset() {
+  if (fingerprints == 0) {
+    fingerprintsSize = 2 * PAGE_COUNT;
+    fingerprints = malloc(fingerprintsSize * sizeof(fingerprint));
+    slotOf = malloc(PAGE_COUNT * sizeof(int));
+  }
+  memset(fingerprints, 0, fingerprintsSize * sizeof(fingerprint));
+  memset(slotOf, -1, PAGE_COUNT * sizeof(int));
+  fingerprintsUsed = 0;
+}
+
+static void fingerprint_set(int slot, uint64_t hash, int pnum, int owner) {
+  int old = fingerprints[slot].pnum;
+  if (old > 0) {
+    slotOf[old] = -1;
+  }
+
+  // A page rewritten since it was indexed is only kept under its new hash
+  dedup_forget(pnum);
+
+  fingerprints[slot].hash = hash;
+  fingerprints[slot].pnum = pnum;
+  fingerprints[slot].owner = owner;
+  slotOf[pnum] = slot;
+}
+
+void dedup_forget(int pnum) {
+  if (slotOf != 0 && slotOf[pnum] >= 0) {
+    fingerprints[slotOf[pnum]].pnum = FORGOTTEN;
+    slotOf[pnum] = -1;
+  }
+}
+
+// Whether a page is still one of the direct pages of a regular file's node
+static int is_data_page_of(int pnum, int owner) {
+  inode* node = get_inode(owner);
+  if (node == 0 || is_folder(node->mode) || is_link(node->mode)) {
+    return 0;
+  }
+
+  for (int ii = 0; ii < 5; ii++) {
+    if (node->ptrs[ii] == pnum) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns the page to use in place of pnum, which is pnum itself if it is unique
+static int dedup_page(int pnum, int owner, dedup_stats* stats) {
+  void* page = pages_get_page(pnum);
+  uint64_t hash = hash64(page, PAGE_SIZE, 0);
+  stats->pages_scanned++;
+
+  // Stale entries pile up as pages are rewritten, start over rather than fill up
+  if (fingerprints == 0 || fingerprintsUsed >= fingerprintsSize * 3 / 4) {
+    fingerprints_reset();
+  }
+
+  int slot = hash % fingerprintsSize;
+  while (fingerprints[slot].pnum != 0) {
+    if (fingerprints[slot].hash == hash && fingerprints[slot].pnum != FORGOTTEN) {
+      int other = fingerprints[slot].pnum;
+
+      if (other == pnum) {
+        return pnum;
+      }
+
+      // A page with too many references to count another is left alone
+      if (is_data_page_of(other, fingerprints[slot].owner) &&
+          memcmp(pages_get_page(other), page, PAGE_SIZE) == 0) {
+        if (page_share(other) != 0) {
+          return pnum;
+        }
+        free_page(pnum);
+        stats->pages_merged++;
+        return other;
+      }
+
+      // The indexed page changed or changed hands, this page takes its place
+      fingerprint_set(slot, hash, pnum, owner);
+      return pnum;
+    }
+
+    slot = (slot + 1) % fingerprintsSize;
+  }
+
+  fingerprint_set(slot, hash, pnum, owner);
+  fingerprintsUsed++;
+  return pnum;
+}
+
+// Deduplicates the direct pages of a single node, not its indirect nodes
+static void dedup_node(inode* node, dedup_stats* stats) {
+  for (int ii = 0; ii < 5; ii++) {
+    if (node->ptrs[ii] != 0) {
+      node->ptrs[ii] = dedup_page(node->ptrs[ii], get_inum(node), stats);
+    }
+  }
+}
+
+static void add_stats(dedup_stats* stats) {
+  totals.pages_scanned += stats->pages_scanned;
+  totals.pages_merged += stats->pages_merged;
+  totals.cpu_ns += stats->cpu_ns;
+}
+
+static double dedup_ratio(dedup_stats* stats) {
+  int64_t kept = stats->pages_scanned - stats->pages_merged;
+  return kept > 0 ? (double)stats->pages_scanned / kept : 1.0;
+}
+
+void dedup_file(inode* node) {
+  dedup_stats stats = {0};
+  int64_t start = cpu_now();
+
+  if (!is_folder(node->mode) && !is_link(node->mode)) {
+    while (node != 0) {
+      dedup_node(node, &stats);
+      node = node->iptr != 0 ? get_inode(node->iptr) : 0;
+    }
+  }
+
+  stats.cpu_ns = cpu_now() - start;
+  add_stats(&stats);
+}
+
+dedup_stats dedup_scan() {
+  dedup_stats stats = {0};
+  int64_t start = cpu_now();
+
+  // Indirect nodes are inodes with their file's mode, so visiting every inode's
+  // direct pages covers each data page exactly once
+  for (int ii = 0; ii < INODE_COUNT; ii++) {
+    inode* node = get_inode(ii);
+    if (node != 0 && !is_folder(node->mode) && !is_link(node->mode)) {
+      dedup_node(node, &stats);
+    }
+  }
+
+  stats.cpu_ns = cpu_now() - start;
+  add_stats(&stats);
+
+  printf("+ dedup_scan() -> merged %ld of %ld pages (ratio %.2f, %ld us cpu)\n",
+         stats.pages_merged, stats.pages_scanned, dedup_ratio(&stats),
+         stats.cpu_ns / 1000);
+
+  return stats;
+}
+
+dedup_stats dedup_get_stats() {
+  return totals;
+}
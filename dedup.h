@@ -0,0 +1,43 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+typedef struct dedup_stats {
+    int64_t pages_scanned; // data pages hashed
+    int64_t pages_merged; // data pages replaced by an identical shared page
+    int64_t cpu_ns; // CPU time spent hashing, comparing and remapping
+} dedup_stats;
+
+/**
+ * @brief Shares every data page of a file that is identical to a page seen before.
+ * 
+ * @param node the file's inode
+ */
+void dedup_file(inode* node);
+
+/**
+ * @brief Drops a page from the index of page contents, called when it's freed so
+ *        that whatever reuses it is never shared into.
+ * 
+ * @param pnum the page
+ */
+void dedup_forget(int pnum);
+
+/**
+ * @brief Deduplicates every regular file in the filesystem.
+ * 
+ * @return dedup_stats the counts for this scan alone
+ */
+dedup_stats dedup_scan();
+
+/**
+ * @brief Gets the running totals for inline and offline deduplication.
+ * 
+ * @return dedup_stats the totals since mount
+ */
+dedup_stats dedup_get_stats();
+
+#endif
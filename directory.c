@@ -1,31 +1,36 @@
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>
 
 #include "bitmap.h"
+#include "hash.h"
 #include "inode.h"
 #include "pages.h"
 #include "slist.h"
+#include "stats.h"
 #include "util.h"
 
 #include "directory.h"
 
-const int DIRENT_COUNT = 4096 / sizeof(dirent); // max dirents per page
+#define DIRENT_COUNT (PAGE_SIZE / (int)sizeof(dirent)) // max dirents per page
 
 void directory_init() {
   // First inode is always reserved for root
   if (!bitmap_get(get_inode_bitmap(), 0)) {
+    // Lands on the first page after the metadata
     int rootPage = alloc_page();
-    assert(rootPage == 5); // Should probably move the data start page to const
+    assert(rootPage == get_superblock()->first_data_page);
 
     int rootIdx = alloc_inode();
     assert(rootIdx == 0);
 
     inode* root = get_inode(rootIdx);
     root->mode = __S_IFDIR | 0755;
-    root->ptrs[0] = 5;
-    root->size = 4096;
+    root->ptrs[0] = rootPage;
+    root->size = PAGE_SIZE;
     time_t currentTime = time(NULL);
     root->atime = currentTime;
     root->ctime = currentTime;
@@ -35,7 +40,139 @@ void directory_init() {
   }
 }
 
-dirent* directory_lookup(inode* dd, const char* name) {
+static int is_variable() {
+  return get_superblock()->dir_format == DIR_FORMAT_VARIABLE;
+}
+
+int directory_name_max() {
+  return is_variable() ? DIR_NAME_MAX : DIR_NAME - 1;
+}
+
+static int record_size(int nameLen) {
+  return (sizeof(dir_record) + nameLen + 1 + 3) & ~3;
+}
+
+static uint16_t name_tag(const char* name, int len) {
+  return hash64(name, len, 0);
+}
+
+static int entry_type(int inum) {
+  inode* node = get_inode(inum);
+  return node != 0 ? (node->mode & S_IFMT) >> 12 : 0;
+}
+
+// The page an entry returned by page_lookup or page_foreach lives in
+static int get_page_of(int* entry) {
+  return ((char*)entry - (char*)pages_get_page(0)) / PAGE_SIZE;
+}
+
+// Bytes taken up by the records at the start of a variable-format page
+static int page_used(void* page) {
+  int offset = 0;
+  while (offset + (int)sizeof(dir_record) <= PAGE_SIZE) {
+    dir_record* rec = page + offset;
+    if (rec->name_len == 0 || offset + record_size(rec->name_len) > PAGE_SIZE) {
+      break;
+    }
+    offset += record_size(rec->name_len);
+  }
+  return offset;
+}
+
+static int page_foreach(void* page, int (*fn)(const char* name, int* entry, void* arg),
+                        void* arg) {
+  if (is_variable()) {
+    int used = page_used(page);
+    for (int offset = 0; offset < used;) {
+      dir_record* rec = page + offset;
+      // Read the size first, fn may remove the record
+      offset += record_size(rec->name_len);
+      int rv = fn(rec->name, &rec->inum, arg);
+      if (rv != 0) {
+        return rv;
+      }
+    }
+  } else {
+    dirent* entries = page;
+    for (int jj = 0; jj < DIRENT_COUNT; jj++) {
+      if (entries[jj].name[0] != 0) {
+        int rv = fn(entries[jj].name, &entries[jj].inum, arg);
+        if (rv != 0) {
+          return rv;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int* page_lookup(void* page, const char* name) {
+  if (is_variable()) {
+    int len = strlen(name);
+    uint16_t tag = name_tag(name, len);
+    int used = page_used(page);
+
+    for (int offset = 0; offset < used;) {
+      dir_record* rec = page + offset;
+      if (rec->tag == tag && rec->name_len == len && memcmp(rec->name, name, len) == 0) {
+        return &rec->inum;
+      }
+      offset += record_size(rec->name_len);
+    }
+  } else {
+    // Untagged entries, free or written before tags were kept, need the full compare
+    uint16_t tag = name_tag(name, strlen(name));
+    dirent* entries = page;
+    for (int jj = 0; jj < DIRENT_COUNT; jj++) {
+      if ((entries[jj].tag == tag || entries[jj].tag == 0) && streq(name, entries[jj].name)) {
+        return &entries[jj].inum;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Adds an entry if the page has room for it, returns -ENOSPC if it doesn't
+static int page_insert(void* page, const char* name, int inum) {
+  int len = strlen(name);
+
+  if (is_variable()) {
+    int used = page_used(page);
+    if (used + record_size(len) > PAGE_SIZE) {
+      return -ENOSPC;
+    }
+
+    dir_record* rec = page + used;
+    rec->inum = inum;
+    rec->tag = name_tag(name, len);
+    rec->type = entry_type(inum);
+    rec->name_len = len;
+    memcpy(rec->name, name, len + 1);
+    return 0;
+  }
+
+  dirent* entries = page;
+  for (int jj = 0; jj < DIRENT_COUNT; jj++) {
+    // Find entry with empty name
+    if (entries[jj].name[0] == 0) {
+      memcpy(entries[jj].name, name, len + 1);
+      entries[jj].inum = inum;
+      entries[jj].tag = name_tag(name, len);
+      return 0;
+    }
+  }
+
+  return -ENOSPC;
+}
+
+static int* lookup_entry(inode* dd, const char* name) {
+  // Free fixed-format slots have empty names
+  if (name[0] == 0) {
+    return 0;
+  }
+
   while (dd > 0) {
     // Verify inode is a directory
     if (is_folder(dd->mode)) {
@@ -43,12 +180,9 @@ dirent* directory_lookup(inode* dd, const char* name) {
       for (int ii = 0; ii < 5; ii++) {
         int pageIdx = dd->ptrs[ii];
         if (pageIdx > 0) {
-          dirent* dir = pages_get_page(pageIdx);
-
-          for (int jj = 0; jj < DIRENT_COUNT; jj++) {
-            if (streq(name, dir[jj].name)) {
-              return &(dir[jj]);
-            }
+          int* entry = page_lookup(pages_get_page(pageIdx), name);
+          if (entry != 0) {
+            return entry;
           }
         }
       }
@@ -68,7 +202,21 @@ dirent* directory_lookup(inode* dd, const char* name) {
   return 0;
 }
 
-int tree_lookup(const char* path) {
+int* directory_lookup(inode* dd, const char* name) {
+  uint64_t start = stats_begin();
+  int* entry = lookup_entry(dd, name);
+  stats_end(STATS_DIRECTORY_LOOKUP, start);
+  return entry;
+}
+
+void directory_set_inum(int* entry, int inum) {
+  *entry = inum;
+  if (is_variable()) {
+    ((dir_record*)entry)->type = entry_type(inum);
+  }
+}
+
+static int lookup_path(const char* path) {
   if (strcmp(path, "/") == 0) {
     return 0;
   }
@@ -77,12 +225,18 @@ int tree_lookup(const char* path) {
   slist* crumbs = s_split(path, '/');
 
   while (crumbs != 0) {
-    dirent* entry = directory_lookup(get_inode(currentInode), crumbs->data);
+    // The leading / splits off an empty name, which would otherwise match a free slot
+    if (crumbs->data[0] == 0) {
+      crumbs = crumbs->next;
+      continue;
+    }
+
+    int* entry = directory_lookup(get_inode(currentInode), crumbs->data);
     if (entry == 0) {
       s_free(crumbs);
       return -ENOENT;
     }
-    currentInode = entry->inum;
+    currentInode = *entry;
     crumbs = crumbs->next;
   }
 
@@ -90,57 +244,156 @@ int tree_lookup(const char* path) {
   return currentInode;
 }
 
-int directory_put(inode* dd, const char* name, int inum) {
-  while (dd != 0) {
-    // Check direct pointers
-    for (int ii = 0; ii < 5; ii++) {
-      // Directory out of space, add more pages
-      if (dd->ptrs[ii] == 0) {
-        int newPageIdx = alloc_page();
+int tree_lookup(const char* path) {
+  uint64_t start = stats_begin();
+  int inum = lookup_path(path);
+  stats_end(STATS_TREE_LOOKUP, start);
+  return inum;
+}
 
-        if (newPageIdx < 0) {
-          return -ENOSPC;
-        }
+// Where directory_put starts looking, per directory: every page before it is full.
+// Kept in memory only, so it starts at 0 after a mount.
+static int* putHints = 0;
 
-        dd->ptrs[ii] = newPageIdx;
-        dd->size += PAGE_SIZE;
-      }
+static int* put_hint(inode* dd) {
+  if (putHints == 0) {
+    putHints = calloc(INODE_COUNT, sizeof(int));
+  }
+  return &putHints[get_inum(dd)];
+}
 
-      dirent* entries = pages_get_page(dd->ptrs[ii]);
-      for (int jj = 0; jj < DIRENT_COUNT; jj++) {
-        // Find entry with empty name
-        if (entries[jj].name[0] == 0) {
-          strncpy(entries[jj].name, name, 48);
-          entries[jj].inum = inum;
-          return 0;
-        }
+void directory_forget(int inum) {
+  if (putHints != 0) {
+    putHints[inum] = 0;
+  }
+}
+
+// The directory's page at position idx in its chain, 0 past the last one
+static int directory_page(inode* dd, int idx) {
+  for (; idx >= 5; idx -= 5) {
+    if (dd->iptr == 0) {
+      return 0;
+    }
+    dd = get_inode(dd->iptr);
+  }
+  return dd->ptrs[idx];
+}
+
+// Where a page is in the directory's chain, -1 if it isn't one of its pages
+static int directory_page_index(inode* dd, int pnum) {
+  for (int base = 0; dd != 0; base += 5) {
+    for (int ii = 0; ii < 5; ii++) {
+      if (dd->ptrs[ii] == pnum) {
+        return base + ii;
       }
     }
+    dd = dd->iptr != 0 ? get_inode(dd->iptr) : 0;
+  }
+  return -1;
+}
 
-    // Out of space in direct pointers, add indirect node
-    // TODO: Propagate size changes to top inode
-    if (dd->iptr == 0) {
-      int rv = grow_inode(dd, dd->size + PAGE_SIZE);
+int directory_put(inode* dd, const char* name, int inum) {
+  if (strlen(name) > directory_name_max()) {
+    return -ENAMETOOLONG;
+  }
+
+  int* hint = put_hint(dd);
+  int idx = *hint;
+  for (int pnum; (pnum = directory_page(dd, idx)) != 0; idx++) {
+    if (page_insert(pages_get_page(pnum), name, inum) == 0) {
+      *hint = idx;
+      return 0;
     }
+  }
 
-    dd = get_inode(dd->iptr);
+  // Every page is full. Growing from the top keeps each node's size the bytes
+  // from it to the end of the chain, like a file's.
+  int rv = grow_inode(dd, max(dd->size, (idx + 1) * PAGE_SIZE));
+  int pnum = directory_page(dd, idx);
+  if (rv < 0 || pnum == 0) {
+    return -ENOSPC;
   }
 
-  return -ENOSPC;
+  *hint = idx;
+  return page_insert(pages_get_page(pnum), name, inum);
 }
 
 int directory_delete(inode* dd, const char* name) {
-  dirent* entry = directory_lookup(dd, name);
+  int* entry = directory_lookup(dd, name);
   if (entry > 0) {
-    entry->inum = 0;
-    memset(entry->name, 0, 48); // I could probably just set the first char to 0, but
-                                // that could have security implications
+    // The page now has room, so the next put can't skip it
+    int idx = directory_page_index(dd, get_page_of(entry));
+    int* hint = put_hint(dd);
+    if (idx >= 0 && idx < *hint) {
+      *hint = idx;
+    }
+
+    directory_remove(entry);
     return 0;
   } else {
     return -ENOENT;
   }
 }
 
+void directory_remove(int* entry) {
+  void* page = pages_get_page(get_page_of(entry));
+
+  if (is_variable()) {
+    // Close the gap so free space stays in one piece at the end of the page
+    dir_record* rec = (dir_record*)entry;
+    int offset = (void*)rec - page;
+    int size = record_size(rec->name_len);
+    int used = page_used(page);
+
+    memmove(rec, (void*)rec + size, used - offset - size);
+    memset(page + used - size, 0, size);
+  } else {
+    // I could probably just set the first char to 0, but that could have
+    // security implications
+    memset((char*)entry - offsetof(dirent, inum), 0, sizeof(dirent));
+  }
+}
+
+typedef struct foreach_ctx {
+  int (*fn)(const char* name, int inum, void* arg);
+  void* arg;
+} foreach_ctx;
+
+static int foreach_entry(const char* name, int* entry, void* arg) {
+  foreach_ctx* ctx = arg;
+  return ctx->fn(name, *entry, ctx->arg);
+}
+
+int directory_foreach(inode* dd, int (*fn)(const char* name, int inum, void* arg), void* arg) {
+  foreach_ctx ctx = { fn, arg };
+
+  while (dd != 0) {
+    for (int ii = 0; ii < 5; ii++) {
+      if (dd->ptrs[ii] != 0) {
+        int rv = page_foreach(pages_get_page(dd->ptrs[ii]), foreach_entry, &ctx);
+        if (rv != 0) {
+          return rv;
+        }
+      }
+    }
+
+    dd = dd->iptr != 0 ? get_inode(dd->iptr) : 0;
+  }
+
+  return 0;
+}
+
+int directory_page_foreach(int pnum, int (*fn)(const char* name, int* entry, void* arg),
+                           void* arg) {
+  return page_foreach(pages_get_page(pnum), fn, arg);
+}
+
+static int list_entry(const char* name, int inum, void* arg) {
+  slist** contents = arg;
+  *contents = s_cons(name, *contents);
+  return 0;
+}
+
 slist* directory_list(const char* path) {
   int dirIdx = tree_lookup(path);
   if (dirIdx < 0) {
@@ -155,27 +408,6 @@ slist* directory_list(const char* path) {
   }
 
   slist* contents = 0;
-
-  while (dir != 0) {
-    // Check direct pointers for entries
-    for (int ii = 0; ii < 5; ii++) {
-      if (dir->ptrs[ii] != 0) {
-        dirent* currentPage = pages_get_page(dir->ptrs[ii]);
-        for (int jj = 0; jj < DIRENT_COUNT; jj++) {
-          if (currentPage[jj].name[0] != 0) {
-            contents = s_cons(currentPage[jj].name, contents);
-          }
-        }
-      }
-    }
-
-    if (dir->iptr != 0) {
-      // Check indirect pointer
-      dir = get_inode(dir->iptr);
-    } else {
-      dir = 0;
-    }
-  }
-
+  directory_foreach(dir, list_entry, &contents);
   return contents;
-}
\ No newline at end of file
+}
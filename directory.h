@@ -4,31 +4,64 @@
 #define DIRECTORY_H
 
 #define DIR_NAME 48
+#define DIR_NAME_MAX 255 // longest name in the variable format
+
+#define DIR_FORMAT_FIXED 0 // DIR_NAME-byte names in 64-byte entries
+#define DIR_FORMAT_VARIABLE 1 // dir_records packed from the start of each page
+
+#include <stdint.h>
 
 #include "slist.h"
 #include "pages.h"
 #include "inode.h"
 
 typedef struct dirent {
-    char name[DIR_NAME];
-    int  inum;
-    char _reserved[12];
+    char     name[DIR_NAME];
+    int      inum;
+    uint16_t tag; // as in dir_record, 0 in entries from before tags were kept
+    char     _reserved[10];
 } dirent;
 
+// Deleting a record moves the ones after it down, so a page's records always end
+// at the first one with an empty name
+typedef struct dir_record {
+    int32_t  inum;
+    uint16_t tag; // low bits of the name's hash, compared before the name
+    uint8_t  type; // the inode's file type, mode >> 12
+    uint8_t  name_len;
+    char     name[]; // name_len bytes and a NUL, padded to a multiple of 4
+} dir_record;
+
 /**
  * @brief Creates /, the root directory.
  */
 void directory_init();
 
 /**
- * @brief Finds the dirent that matches the filename in the given folder's inode.
+ * @brief Gets the longest name the image's directory format can hold.
+ * 
+ * @return int the length in bytes, not counting the NUL
+ */
+int directory_name_max();
+
+/**
+ * @brief Finds the entry that matches the filename in the given folder's inode.
  *        Files cannot have the same name.
  * 
  * @param dd the inode corresponding to the parent directory
  * @param name the filename to find
- * @return dirent* the directory entry, returns 0 if file not found
+ * @return int* the entry's inode number, returns 0 if file not found. Only valid
+ *         until the directory is next changed.
  */
-dirent* directory_lookup(inode* dd, const char* name);
+int* directory_lookup(inode* dd, const char* name);
+
+/**
+ * @brief Points an existing entry at a different inode.
+ * 
+ * @param entry the entry's inode number, from directory_lookup
+ * @param inum the new inode
+ */
+void directory_set_inum(int* entry, int inum);
 
 /**
  * @brief Finds the index of the inode that corresponds to the path.
@@ -44,7 +77,8 @@ int tree_lookup(const char* path);
  * @param dd the inode of the parent directory
  * @param name the name of the file to add
  * @param inum the inode of the file
- * @return int 0 if successful, ENOSPC if no pages or inodes are left
+ * @return int 0 if successful, ENOSPC if no pages or inodes are left,
+ *         ENAMETOOLONG if the name is longer than directory_name_max
  */
 int directory_put(inode* dd, const char* name, int inum);
 
@@ -57,6 +91,44 @@ int directory_put(inode* dd, const char* name, int inum);
  */
 int directory_delete(inode* dd, const char* name);
 
+/**
+ * @brief Drops where directory_put starts looking in a directory, which has to be
+ *        done whenever the inode is freed so a directory reusing it starts over.
+ * 
+ * @param inum the index of the inode
+ */
+void directory_forget(int inum);
+
+/**
+ * @brief Deletes the entry, moving any that come after it in the same page.
+ * 
+ * @param entry the entry's inode number, from directory_lookup
+ */
+void directory_remove(int* entry);
+
+/**
+ * @brief Calls a function on every entry in a directory, stopping early if it
+ *        returns nonzero.
+ * 
+ * @param dd the inode of the directory
+ * @param fn the function to call with each entry's name, inode index and arg
+ * @param arg passed through to fn
+ * @return int 0 if every call returned 0, otherwise the first nonzero return value
+ */
+int directory_foreach(inode* dd, int (*fn)(const char* name, int inum, void* arg), void* arg);
+
+/**
+ * @brief Calls a function on every entry in one directory page, stopping early if
+ *        it returns nonzero. For tools that check the pages themselves.
+ * 
+ * @param pnum the page
+ * @param fn the function to call with each entry's name, inode number and arg
+ * @param arg passed through to fn
+ * @return int 0 if every call returned 0, otherwise the first nonzero return value
+ */
+int directory_page_foreach(int pnum, int (*fn)(const char* name, int* entry, void* arg),
+                           void* arg);
+
 /**
  * @brief Creates a list of items in a directory.
  * 
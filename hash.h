@@ -0,0 +1,17 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Hashes a buffer with XXH64.
+ * 
+ * @param data the bytes to hash
+ * @param len the number of bytes
+ * @param seed the starting value, hashes with different seeds are unrelated
+ * @return uint64_t the hash
+ */
+uint64_t hash64(const void* data, size_t len, uint64_t seed);
+
+#endif
@@ -1,39 +1,47 @@
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "bitmap.h"
+#include "compress.h"
+#include "directory.h"
 #include "pages.h"
+#include "stats.h"
+#include "timestamps.h"
 #include "util.h"
 
 #include "inode.h"
 
-const int INODE_COUNT = 256; // assumed to be 4 pages, root currently needs to be page 5
-
-void inodes_init() {
-  void* pbm = get_pages_bitmap();
-  if (!bitmap_get(pbm, 1)) {
-    int pagesNeeded = bytes_to_pages(INODE_COUNT * sizeof(inode));
-    for (int ii = 1; ii <= pagesNeeded; ii++) {
-      // inode pages should be adjacent for one big contiguous block
-      assert(alloc_page() == ii);
-    }
-  }
-}
+int INODE_COUNT = 256;
 
 inode* get_inode(int inum) {
   if (inum >= 0 && inum < INODE_COUNT && bitmap_get(get_inode_bitmap(), inum)) {
-    return ((inode*)pages_get_page(1)) + inum;
+    return ((inode*)pages_get_page(get_superblock()->inode_table_page)) + inum;
   } else {
     return 0;
   }
 }
 
+int get_inum(inode* node) {
+  return node - (inode*)pages_get_page(get_superblock()->inode_table_page);
+}
+
 int alloc_inode() {
   void* ibm = get_inode_bitmap();
+  superblock* sb = get_superblock();
+
+  // Full, no need to scan the bitmap to find out
+  if (sb->free_inodes <= 0) {
+    return -ENOSPC;
+  }
 
   for (int ii = 0; ii < INODE_COUNT; ii++) {
     if (!bitmap_get(ibm, ii)) {
       bitmap_put(ibm, ii, 1);
+      sb->free_inodes--;
+      memset(get_inode(ii), 0, sizeof(inode));
       printf("+ alloc_inode() -> %d\n", ii);
       return ii;
     }
@@ -42,34 +50,121 @@ int alloc_inode() {
   return -ENOSPC;
 }
 
-void free_inode(int inum) {
-  inode* node = get_inode(inum);
+// Pages to be freed together with free_pages
+typedef struct page_list {
+  int* pnums;
+  int count;
+  int cap;
+} page_list;
+
+static void page_list_add(page_list* list, int pnum) {
+  if (list->count == list->cap) {
+    list->cap = list->cap > 0 ? 2 * list->cap : 16;
+    list->pnums = realloc(list->pnums, list->cap * sizeof(int));
+  }
+  list->pnums[list->count++] = pnum;
+}
+
+// Clears an inode and its chain of indirect nodes, collecting their pages
+static void release_chain(int inum, page_list* pages) {
+  inode* node;
+
+  while (inum != 0 && (node = get_inode(inum)) != 0) {
+    for (int ii = 0; ii < 5; ii++) {
+      if (node->ptrs[ii] != 0) {
+        page_list_add(pages, node->ptrs[ii]);
+        node->ptrs[ii] = 0;
+      }
+    }
 
-  if (inum == 0 || node == 0) {
-    return;
+    int next = node->iptr;
+    node->size = 0;
+    node->mode = 0;
+    node->iptr = 0;
+    timestamps_forget(inum);
+    compress_forget(inum);
+    directory_forget(inum);
+    bitmap_put(get_inode_bitmap(), inum, 0);
+    get_superblock()->free_inodes++;
+    inum = next;
   }
+}
 
+void free_inode(int inum) {
+  page_list pages = {0};
+  release_chain(inum, &pages);
+  free_pages(pages.pnums, pages.count);
+  free(pages.pnums);
+}
+
+static int share_chain(inode* dst, inode* src) {
   for (int ii = 0; ii < 5; ii++) {
-    if (node->ptrs[ii] != 0) {
-      free_page(node->ptrs[ii]);
-      node->ptrs[ii] = 0;
+    int pnum = src->ptrs[ii];
+
+    // Pages with too many references to count another get a copy instead
+    if (pnum != 0 && page_share(pnum) != 0) {
+      int copy = alloc_page();
+      if (copy < 0) {
+        return -ENOSPC;
+      }
+      memcpy(pages_get_page(copy), pages_get_page(pnum), PAGE_SIZE);
+      pnum = copy;
     }
+    dst->ptrs[ii] = pnum;
   }
 
-  free_inode(node->iptr);
+  dst->size = src->size;
+  dst->flags = (dst->flags & ~INODE_COMPRESSED) | (src->flags & INODE_COMPRESSED);
+
+  if (src->iptr != 0) {
+    int newNodeIdx = alloc_inode();
 
-  node->size = 0;
-  node->mode = 0;
-  node->iptr = 0;
+    if (newNodeIdx < 0) {
+      return -ENOSPC;
+    }
+
+    inode* newNode = get_inode(newNodeIdx);
+    newNode->mode = dst->mode;
+    dst->iptr = newNodeIdx;
 
-  bitmap_put(get_inode_bitmap(), inum, 0);
+    return share_chain(newNode, get_inode(src->iptr));
+  }
+
+  return 0;
 }
 
-int grow_inode(inode* node, int size) {
+int share_inode(inode* dst, inode* src) {
+  // Make sure every indirect node fits before touching dst, so it's never left half shared
+  int needed = 0;
+  for (inode* node = src; node->iptr != 0; node = get_inode(node->iptr)) {
+    needed++;
+  }
+  if (needed > get_superblock()->free_inodes) {
+    return -ENOSPC;
+  }
+
+  // Copying pages can still run out of space, in which case dst is emptied again
+  int rv = share_chain(dst, src);
+  if (rv < 0) {
+    shrink_inode(dst, 0);
+    dst->flags &= ~INODE_COMPRESSED;
+  }
+  return rv;
+}
+
+static int grow_chain(inode* node, int size) {
   assert(node->size <= size);
 
   // Target size is larger than direct pages
   if (size > 5 * PAGE_SIZE) {
+    // Fill the direct pages first in case the size jumps past them
+    if (node->size < 5 * PAGE_SIZE) {
+      int rv = grow_chain(node, 5 * PAGE_SIZE);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+
     // Add indirect node if nonexistent
     if (node->iptr == 0) {
       int newNodeIdx = alloc_inode();
@@ -85,7 +180,7 @@ int grow_inode(inode* node, int size) {
 
     node->size = size;
 
-    return grow_inode(get_inode(node->iptr), size - 5 * PAGE_SIZE);
+    return grow_chain(get_inode(node->iptr), size - 5 * PAGE_SIZE);
   }
 
   int pagesNeeded = bytes_to_pages(size);
@@ -106,6 +201,13 @@ int grow_inode(inode* node, int size) {
   return 0;
 }
 
+int grow_inode(inode* node, int size) {
+  uint64_t start = stats_begin();
+  int rv = grow_chain(node, size);
+  stats_end(STATS_GROW_INODE, start);
+  return rv;
+}
+
 int shrink_inode(inode* node, int size) {
   assert(node->size >= size);
 
@@ -117,23 +219,110 @@ int shrink_inode(inode* node, int size) {
   }
 
   int pagesNeeded = bytes_to_pages(size);
+  page_list pages = {0};
 
   // Free unused direct pages
   for (int ii = 4; ii >= pagesNeeded; ii--) {
     if (node->ptrs[ii] != 0) {
-      free_page(node->ptrs[ii]);
+      page_list_add(&pages, node->ptrs[ii]);
       node->ptrs[ii] = 0;
     }
   }
 
   // Free unused indirect nodes
   if (node->iptr > 0) {
-    free_inode(node->iptr);
+    release_chain(node->iptr, &pages);
+    node->iptr = 0;
   }
 
+  free_pages(pages.pnums, pages.count);
+  free(pages.pnums);
+
   return 0;
 }
 
+int* inode_page_slot(inode* node, int pageIdx) {
+  while (pageIdx >= 5) {
+    if (node->iptr == 0) {
+      return 0;
+    }
+    node = get_inode(node->iptr);
+    pageIdx -= 5;
+  }
+
+  return &(node->ptrs[pageIdx]);
+}
+
+int inode_advise(inode* node, int pageIdx, int count, int advice) {
+  int end = min(pageIdx + count, bytes_to_pages(node->size));
+  int runStart = 0;
+  int runLength = 0;
+  int advised = 0;
+
+  for (int ii = pageIdx; ii < end; ii++) {
+    int* slot = inode_page_slot(node, ii);
+    if (slot == 0) {
+      break;
+    }
+
+    int pnum = *slot;
+    advised++;
+    if (runLength > 0 && pnum == runStart + runLength) {
+      runLength++;
+      continue;
+    }
+
+    if (runLength > 0) {
+      pages_advise(runStart, runLength, advice);
+    }
+    runStart = pnum;
+    runLength = 1;
+  }
+
+  if (runLength > 0) {
+    pages_advise(runStart, runLength, advice);
+  }
+
+  return advised;
+}
+
+static int compare_ints(const void* aa, const void* bb) {
+  return *(const int*)aa - *(const int*)bb;
+}
+
+int inodes_prefetch(int* inums, int count) {
+  qsort(inums, count, sizeof(int), compare_ints);
+
+  // Sorted indices land on the table's pages in order, so each page comes up once
+  int tablePage = get_superblock()->inode_table_page;
+  int runStart = -1;
+  int runEnd = -1;
+  int advised = 0;
+
+  for (int ii = 0; ii < count; ii++) {
+    int pnum = tablePage + (int)((size_t)inums[ii] * sizeof(inode) / PAGE_SIZE);
+    if (pnum <= runEnd) {
+      continue;
+    }
+
+    if (pnum == runEnd + 1) {
+      runEnd = pnum;
+    } else {
+      if (runStart >= 0) {
+        pages_advise(runStart, runEnd - runStart + 1, MADV_WILLNEED);
+      }
+      runStart = runEnd = pnum;
+    }
+    advised++;
+  }
+
+  if (runStart >= 0) {
+    pages_advise(runStart, runEnd - runStart + 1, MADV_WILLNEED);
+  }
+
+  return advised;
+}
+
 // Currently unused, calculates the total references for an inode and all connected indirect nodes
 // since each inode only stores the number of references for its direct pointers
 int total_refs(inode* node) {
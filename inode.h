@@ -7,22 +7,23 @@
 
 #include "pages.h"
 
+extern int INODE_COUNT; // from the superblock, set by pages_map
+
+#define INODE_READONLY 0x1 // inode belongs to a snapshot and cannot be modified
+#define INODE_COMPRESSED 0x2 // pages hold a compressed stream, see compress.h
+
 typedef struct inode {
     int refs; // reference count
     mode_t mode; // permission & type
     int size; // bytes
     int ptrs[5]; // direct pointers
     int iptr; // single indirect pointer
+    int flags; // INODE_* flags, fits in padding before the timestamps
     time_t atime; // last access time
     time_t mtime; // last modification time
     time_t ctime; // last change time
 } inode;
 
-/**
- * @brief Reserves the pages needed for inodes
- */
-void inodes_init();
-
 /**
  * @brief Get the inode of the specified index
  * 
@@ -31,6 +32,14 @@ void inodes_init();
  */
 inode* get_inode(int inum);
 
+/**
+ * @brief Gets the index of an inode from get_inode.
+ * 
+ * @param node the inode
+ * @return int its index in the inode table
+ */
+int get_inum(inode* node);
+
 /**
  * @brief Allocates a free inode.
  * 
@@ -45,6 +54,18 @@ int alloc_inode();
  */
 void free_inode(int inum);
 
+/**
+ * @brief Makes an empty inode share all data pages of another, copy-on-write.
+ *        Indirect nodes are duplicated since they hold per-file state.
+ * 
+ * @param dst the inode to fill, must not own any pages or indirect nodes
+ * @param src the inode whose pages are shared
+ * @return int 0 if successful, ENOSPC if out of inodes for indirect nodes or out
+ *         of pages for copying pages that can't be shared any further, in which
+ *         case dst is left empty
+ */
+int share_inode(inode* dst, inode* src);
+
 /**
  * @brief Increases inode's size.
  * 
@@ -63,4 +84,34 @@ int grow_inode(inode* node, int size);
  */
 int shrink_inode(inode* node, int size);
 
+/**
+ * @brief Finds the page pointer for a page of a file, following indirect nodes.
+ * 
+ * @param node the file's inode
+ * @param pageIdx the index of the page within the file
+ * @return int* the pointer to the page number, 0 if the file has no node that far
+ */
+int* inode_page_slot(inode* node, int pageIdx);
+
+/**
+ * @brief Passes an madvise hint for a range of a file's pages, one contiguous run
+ *        of the image at a time.
+ * 
+ * @param node the file's inode
+ * @param pageIdx the index of the first page within the file
+ * @param count the number of pages, clipped to the end of the file
+ * @return int the number of pages advised
+ */
+int inode_advise(inode* node, int pageIdx, int count, int advice);
+
+/**
+ * @brief Asks for the inode table pages holding a set of inodes to be read in,
+ *        so looking them up one after another doesn't fault on each.
+ * 
+ * @param inums the inode indices, sorted in place
+ * @param count the number of indices
+ * @return int the number of inode table pages advised
+ */
+int inodes_prefetch(int* inums, int count);
+
 #endif
@@ -0,0 +1,36 @@
+#ifndef IOCTLS_H
+#define IOCTLS_H
+
+#include <stdint.h>
+#include <linux/ioctl.h>
+
+/**
+ * @brief Arguments for NUFS_IOC_CLONE, issued on the destination file. Paths are
+ *        relative to the root of the mount, e.g. "/dir/file".
+ */
+typedef struct nufs_clone_args {
+    char src[4096]; // the file to clone from
+    int64_t src_offset; // where to start in the source
+    int64_t src_length; // bytes to clone, 0 clones to the end of the source
+    int64_t dest_offset; // where to put the data in the destination
+} nufs_clone_args;
+
+// Shares the source's pages with the destination until either is modified
+#define NUFS_IOC_CLONE _IOW('N', 1, nufs_clone_args)
+
+/**
+ * @brief Results of NUFS_IOC_DEDUP.
+ */
+typedef struct nufs_dedup_result {
+    int64_t pages_scanned; // data pages hashed
+    int64_t pages_merged; // data pages now shared with an identical page
+    int64_t cpu_ns; // CPU time the scan took
+} nufs_dedup_result;
+
+// Scans every file for identical pages and shares them, can be issued on any file
+#define NUFS_IOC_DEDUP _IOR('N', 2, nufs_dedup_result)
+
+// FITRIM from <linux/fs.h> also works on any file, releasing free pages of the
+// image to the host. fstrim_range offsets are bytes within the image.
+
+#endif
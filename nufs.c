@@ -4,8 +4,14 @@
 #include <bsd/string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -14,13 +20,54 @@
 #include <fuse.h>
 
 // #include "directory.h"
+#include "dedup.h"
+#include "ioctls.h"
+#include "options.h"
+#include "pages.h"
+#include "stats.h"
 #include "storage.h"
+#include "trace.h"
 #include "util.h"
 
+// STATS_DIR and the files in it aren't in the image, their text is made on each
+// read. Returns the STATS_* format of a stats file, -1 for anything else.
+static int stats_file(const char *path) {
+  if (streq(path, STATS_JSON_FILE)) {
+    return STATS_JSON;
+  } else if (streq(path, STATS_PROMETHEUS_FILE)) {
+    return STATS_PROMETHEUS;
+  }
+  return -1;
+}
+
+// Fills in the attributes of STATS_DIR and its files, returns 0 for other paths
+static int stats_stat(const char *path, struct stat *st) {
+  if (!streq(path, STATS_DIR) && stats_file(path) < 0) {
+    return 0;
+  }
+
+  memset(st, 0, sizeof(struct stat));
+  st->st_uid = getuid();
+  if (streq(path, STATS_DIR)) {
+    st->st_mode = __S_IFDIR | 0555;
+    st->st_nlink = 2;
+  } else {
+    // The size isn't known until it's read, direct_io makes the kernel read to EOF
+    st->st_mode = __S_IFREG | 0444;
+    st->st_nlink = 1;
+  }
+  return 1;
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_access(path, mask);
+  storage_unlock();
+  stats_end(STATS_OP_ACCESS, start);
+  trace_op(STATS_OP_ACCESS, start, path, 0, 0, mask, rv);
   printf("access(%s, %04o) -> %d\n", path, mask, rv);
   return rv;
 }
@@ -28,42 +75,81 @@ int nufs_access(const char *path, int mask) {
 // implementation for: man 2 stat
 // gets an object's attributes (type, permissions, size, etc)
 int nufs_getattr(const char *path, struct stat *st) {
-  int rv = storage_stat(path, st);
+  uint64_t start = stats_begin();
+  int rv = 0;
+  if (!stats_stat(path, st)) {
+    storage_lock();
+    rv = storage_stat(path, st);
+    storage_unlock();
+  }
+  stats_end(STATS_OP_GETATTR, start);
+  trace_op(STATS_OP_GETATTR, start, path, 0, 0, 0, rv);
   printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
          st->st_size);
   return rv;
 }
 
+// implementation for: man 2 statfs
+// reports free space from the superblock's counters
+int nufs_statfs(const char *path, struct statvfs *st) {
+  uint64_t start = stats_begin();
+  storage_lock();
+  int rv = storage_statfs(st);
+  storage_unlock();
+  stats_end(STATS_OP_STATFS, start);
+  trace_op(STATS_OP_STATFS, start, path, 0, 0, 0, rv);
+  printf("statfs(%s) -> (%d) {free: %ld of %ld}\n", path, rv, st->f_bfree,
+         st->f_blocks);
+  return rv;
+}
+
+typedef struct readdir_ctx {
+  void* buf;
+  fuse_fill_dir_t filler;
+} readdir_ctx;
+
+static int readdir_entry(const char* name, const struct stat* st, void* arg) {
+  readdir_ctx* ctx = arg;
+  return ctx->filler(ctx->buf, name, st, 0);
+}
+
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory, with each entry's attributes filled in
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
-  struct stat st;
-  int rv;
-
-  slist* contents = storage_list(path);
+  uint64_t start = stats_begin();
+  readdir_ctx ctx = { buf, filler };
+  int rv = 0;
 
-  // Add directory items to buffer
-  while (contents != 0) {
-    char fullPath[4096];  // max pathname is 4096 chars
-    strncpy(fullPath, path, 4096);
-    join_to_path(fullPath, contents->data);
-    rv = nufs_getattr(fullPath, &st);
-    assert(rv == 0);
-    filler(buf, contents->data, &st, 0);
-    contents = contents->next;
+  if (streq(path, STATS_DIR)) {
+    struct stat st;
+    stats_stat(STATS_DIR, &st);
+    filler(buf, ".", &st, 0);
+    filler(buf, "..", &st, 0);
+    stats_stat(STATS_JSON_FILE, &st);
+    filler(buf, STATS_JSON_FILE + strlen(STATS_DIR "/"), &st, 0);
+    filler(buf, STATS_PROMETHEUS_FILE + strlen(STATS_DIR "/"), &st, 0);
+  } else {
+    storage_lock();
+    rv = storage_readdir(path, readdir_entry, &ctx);
+    storage_unlock();
   }
 
-  s_free(contents);
-
+  stats_end(STATS_OP_READDIR, start);
+  trace_op(STATS_OP_READDIR, start, path, 0, 0, 0, rv);
   printf("readdir(%s) -> %d\n", path, rv);
-  return 0;
+  return rv;
 }
 
 // mknod makes a filesystem object like a file or directory
 // called for: man 2 open, man 2 link
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_mknod(path, mode);
+  storage_unlock();
+  stats_end(STATS_OP_MKNOD, start);
+  trace_op(STATS_OP_MKNOD, start, path, 0, 0, mode, rv);
   printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
@@ -71,75 +157,169 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_mkdir(path, mode);
+  storage_unlock();
+  stats_end(STATS_OP_MKDIR, start);
+  trace_op(STATS_OP_MKDIR, start, path, 0, 0, mode, rv);
   printf("mkdir(%s) -> %d\n", path, rv);
   return rv;
 }
 
 int nufs_unlink(const char *path) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_unlink(path);
+  storage_unlock();
+  stats_end(STATS_OP_UNLINK, start);
+  trace_op(STATS_OP_UNLINK, start, path, 0, 0, 0, rv);
   printf("unlink(%s) -> %d\n", path, rv);
   return rv;
 }
 
 int nufs_link(const char *from, const char *to) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_link(from, to);
+  storage_unlock();
+  stats_end(STATS_OP_LINK, start);
+  trace_op(STATS_OP_LINK, start, from, to, 0, 0, rv);
   printf("link(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
 int nufs_symlink(const char* to, const char* from) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_symlink(to, from);
+  storage_unlock();
+  stats_end(STATS_OP_SYMLINK, start);
+  trace_op(STATS_OP_SYMLINK, start, from, to, 0, 0, rv);
   printf("symlink(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
 int nufs_readlink(const char* path, char* buf, size_t size) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_readlink(path, buf, size);
+  storage_unlock();
+  stats_end(STATS_OP_READLINK, start);
+  trace_op(STATS_OP_READLINK, start, path, 0, 0, size, rv);
   printf("readlink(%s => %s) -> %d\n", path, buf, rv);
   return rv;
 }
 
 int nufs_rmdir(const char *path) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_rmdir(path);
+  storage_unlock();
+  stats_end(STATS_OP_RMDIR, start);
+  trace_op(STATS_OP_RMDIR, start, path, 0, 0, 0, rv);
   printf("rmdir(%s) -> %d\n", path, rv);
   return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
+// FUSE 2 doesn't pass renameat2 flags through, so this is always a plain rename
 int nufs_rename(const char *from, const char *to) {
-  int rv = storage_rename(from, to);
+  uint64_t start = stats_begin();
+  storage_lock();
+  int rv = storage_rename(from, to, 0);
+  storage_unlock();
+  stats_end(STATS_OP_RENAME, start);
+  trace_op(STATS_OP_RENAME, start, from, to, 0, 0, rv);
   printf("rename(%s => %s) -> %d\n", from, to, rv);
   return rv;
 }
 
 int nufs_chmod(const char *path, mode_t mode) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_chmod(path, mode);
+  storage_unlock();
+  stats_end(STATS_OP_CHMOD, start);
+  trace_op(STATS_OP_CHMOD, start, path, 0, 0, mode, rv);
   printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
   return rv;
 }
 
 int nufs_truncate(const char *path, off_t size) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_truncate(path, size);
+  storage_unlock();
+  stats_end(STATS_OP_TRUNCATE, start);
+  trace_op(STATS_OP_TRUNCATE, start, path, 0, size, 0, rv);
   printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
   return rv;
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
+// this is called on open, but FUSE doesn't assume you maintain
+// state for open files. The only state kept is the access pattern
+// used for readahead. With -o sequential or -o random the file's
+// pages also get that madvise hint.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  // TODO: Find out what actually happens here instead of just doing nothing
+  uint64_t start = stats_begin();
   int rv = 0;
+  if (stats_file(path) >= 0) {
+    fi->fh = 0;
+    fi->direct_io = 1;
+    rv = (fi->flags & O_ACCMODE) == O_RDONLY ? 0 : -EACCES;
+    stats_end(STATS_OP_OPEN, start);
+    trace_op(STATS_OP_OPEN, start, path, 0, 0, fi->flags, rv);
+    printf("open(%s) -> %d\n", path, rv);
+    return rv;
+  }
+
+  readahead_state *ra = malloc(sizeof(readahead_state));
+  if (ra != 0) {
+    readahead_reset(ra);
+  }
+  fi->fh = (uintptr_t)ra;
+
+  if (options.advice) {
+    storage_lock();
+    rv = storage_advise(path, options.advice);
+    storage_unlock();
+  }
+  stats_end(STATS_OP_OPEN, start);
+  trace_op(STATS_OP_OPEN, start, path, 0, 0, fi->flags, rv);
   printf("open(%s) -> %d\n", path, rv);
   return rv;
 }
 
+// Copies data out for read and for read_buf's fallback, which count it themselves
+static int read_copy(const char *path, char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+  storage_lock();
+  int rv;
+  if (stats_file(path) >= 0) {
+    size_t length;
+    char *text = stats_render(stats_file(path), &length);
+    rv = offset < length ? min(size, length - offset) : 0;
+    memcpy(buf, text + offset, rv);
+    free(text);
+  } else {
+    rv = storage_read(path, buf, size, offset);
+  }
+  if (rv > 0 && fi->fh != 0) {
+    storage_readahead(path, (readahead_state *)(uintptr_t)fi->fh, offset, rv);
+  }
+  storage_unlock();
+  return rv;
+}
+
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int rv = storage_read(path, buf, size, offset);
+  uint64_t start = stats_begin();
+  int rv = read_copy(path, buf, size, offset, fi);
+  stats_end(STATS_OP_READ, start);
+  trace_op(STATS_OP_READ, start, path, 0, offset, size, rv);
   printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
@@ -147,32 +327,212 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_write(path, buf, size, offset);
+  storage_unlock();
+  stats_end(STATS_OP_WRITE, start);
+  trace_op(STATS_OP_WRITE, start, path, 0, offset, size, rv);
   printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
   return rv;
 }
 
+// Builds a bufvec of image file ranges, which FUSE can splice without copying
+static struct fuse_bufvec *extents_to_bufvec(storage_extent *extents, int count) {
+  struct fuse_bufvec *bufv =
+      malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+  *bufv = FUSE_BUFVEC_INIT(0);
+  bufv->count = count;
+
+  for (int ii = 0; ii < count; ii++) {
+    bufv->buf[ii].size = extents[ii].size;
+    bufv->buf[ii].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[ii].mem = NULL;
+    bufv->buf[ii].fd = extents[ii].fd;
+    bufv->buf[ii].pos = extents[ii].pos;
+  }
+
+  return bufv;
+}
+
+// Pages spliced by the reply to this thread's last read_buf. FUSE sends a reply
+// before the thread takes another request, so they're unpinned on its next one.
+static __thread storage_pins readPins;
+
+// Read data by pointing FUSE at the image file instead of copying it out
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                  off_t offset, struct fuse_file_info *fi) {
+  uint64_t start = stats_begin();
+  storage_extent *extents = malloc((size / PAGE_SIZE + 2) * sizeof(storage_extent));
+
+  storage_lock();
+  storage_unpin(&readPins);
+  // Stats files are made in memory, like the contents of compressed files
+  int rv = stats_file(path) >= 0 ? -ENOTSUP
+                                 : storage_read_extents(path, size, offset, extents, &readPins);
+  size_t total = 0;
+  for (int ii = 0; ii < rv; ii++) {
+    total += extents[ii].size;
+  }
+  if (total > 0 && fi->fh != 0) {
+    storage_readahead(path, (readahead_state *)(uintptr_t)fi->fh, offset, total);
+  }
+  storage_unlock();
+
+  if (rv >= 0) {
+    *bufp = extents_to_bufvec(extents, rv);
+  } else if (rv == -ENOTSUP) {
+    // Compressed and stats files have to be made in memory, FUSE frees it
+    char *data = malloc(size);
+    rv = read_copy(path, data, size, offset, fi);
+    *bufp = malloc(sizeof(struct fuse_bufvec));
+    **bufp = FUSE_BUFVEC_INIT(rv > 0 ? rv : 0);
+    (*bufp)->buf[0].mem = data;
+  }
+
+  free(extents);
+  stats_end(STATS_OP_READ_BUF, start);
+  trace_op(STATS_OP_READ_BUF, start, path, 0, offset, size, rv);
+  printf("read_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  return rv < 0 ? rv : 0;
+}
+
+// Write data by splicing it from FUSE straight into the image file
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                   struct fuse_file_info *fi) {
+  uint64_t start = stats_begin();
+  size_t size = fuse_buf_size(buf);
+  storage_extent *extents = malloc((size / PAGE_SIZE + 2) * sizeof(storage_extent));
+
+  // Held through the copy so the pages can't be freed or shared underneath it
+  storage_lock();
+  int rv = storage_write_extents(path, size, offset, extents);
+  if (rv >= 0) {
+    struct fuse_bufvec *dst = extents_to_bufvec(extents, rv);
+    rv = fuse_buf_copy(dst, buf, 0);
+    free(dst);
+  }
+  storage_unlock();
+
+  free(extents);
+  stats_end(STATS_OP_WRITE_BUF, start);
+  trace_op(STATS_OP_WRITE_BUF, start, path, 0, offset, size, rv);
+  printf("write_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  return rv;
+}
+
+// Called when the last descriptor of an open file is closed
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  uint64_t start = stats_begin();
+  int rv = 0;
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    storage_lock();
+    rv = storage_flush(path);
+    storage_unlock();
+  }
+  free((readahead_state *)(uintptr_t)fi->fh);
+  stats_end(STATS_OP_RELEASE, start);
+  trace_op(STATS_OP_RELEASE, start, path, 0, 0, fi->flags, rv);
+  printf("release(%s) -> %d\n", path, rv);
+  return rv;
+}
+
+// Writes a file's lazily kept timestamps back and syncs the image
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  uint64_t start = stats_begin();
+  storage_lock();
+  int rv = storage_fsync(path);
+  storage_unlock();
+  stats_end(STATS_OP_FSYNC, start);
+  trace_op(STATS_OP_FSYNC, start, path, 0, 0, datasync, rv);
+  printf("fsync(%s, %d) -> %d\n", path, datasync, rv);
+  return rv;
+}
+
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
+  uint64_t start = stats_begin();
+  storage_lock();
   int rv = storage_set_time(path, ts);
+  storage_unlock();
+  stats_end(STATS_OP_UTIMENS, start);
+  trace_op(STATS_OP_UTIMENS, start, path, 0, ts[0].tv_sec, ts[1].tv_sec, rv);
   printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
          ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
   return rv;
 }
 
-// Extended operations
+// Extended operations, see ioctls.h
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  // TODO: Find out what this does
-  int rv = -1;
+  uint64_t start = stats_begin();
+  int rv = -ENOTTY;
+
+  storage_lock();
+  if (flags & FUSE_IOCTL_COMPAT) {
+    rv = -ENOSYS;
+  } else if ((unsigned int)cmd == NUFS_IOC_CLONE) {
+    nufs_clone_args *args = data;
+    args->src[sizeof(args->src) - 1] = 0;
+
+    if (args->src_offset == 0 && args->src_length == 0 && args->dest_offset == 0) {
+      rv = storage_clone(args->src, path);
+    } else {
+      size_t length = args->src_length > 0 ? args->src_length : SIZE_MAX;
+      rv = storage_copy_range(args->src, args->src_offset, path,
+                              args->dest_offset, length);
+      rv = rv < 0 ? rv : 0;
+    }
+  } else if ((unsigned int)cmd == FITRIM) {
+    // Like fstrim, but issued on any file in the mount. Offsets are image bytes.
+    // Only whole pages inside [start, start + len) are trimmed, and fstrim passes
+    // the largest len there is to mean the whole image
+    struct fstrim_range *range = data;
+    uint64_t len = range->len < UINT64_MAX - range->start ? range->len : UINT64_MAX - range->start;
+    uint64_t first = range->start / PAGE_SIZE + (range->start % PAGE_SIZE != 0);
+    uint64_t end = (range->start + len) / PAGE_SIZE;
+    uint64_t minRun = (range->minlen + PAGE_SIZE - 1) / PAGE_SIZE;
+    first = first < PAGE_COUNT ? first : PAGE_COUNT;
+    end = end < PAGE_COUNT ? end : PAGE_COUNT;
+    minRun = minRun < PAGE_COUNT ? minRun : PAGE_COUNT;
+    int count = end > first ? end - first : 0;
+    range->len = (uint64_t)pages_trim(first, count, minRun > 0 ? minRun : 1) * PAGE_SIZE;
+    rv = 0;
+  } else if ((unsigned int)cmd == NUFS_IOC_DEDUP) {
+    dedup_stats stats = dedup_scan();
+    nufs_dedup_result *result = data;
+    result->pages_scanned = stats.pages_scanned;
+    result->pages_merged = stats.pages_merged;
+    result->cpu_ns = stats.cpu_ns;
+    rv = 0;
+  }
+  storage_unlock();
+
+  stats_end(STATS_OP_IOCTL, start);
+  trace_op(STATS_OP_IOCTL, start, path, 0, 0, cmd, rv);
   printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
   return rv;
 }
 
+// Called once FUSE has daemonized, so background threads survive the fork
+void *nufs_init(struct fuse_conn_info *conn) {
+  storage_start();
+  printf("init()\n");
+  return NULL;
+}
+
+// Called on unmount
+void nufs_destroy(void *private_data) {
+  trace_close();
+  storage_stop();
+  printf("destroy()\n");
+}
+
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->statfs = nufs_statfs;
   ops->readdir = nufs_readdir;
   ops->mknod = nufs_mknod;
   ops->mkdir = nufs_mkdir;
@@ -187,15 +547,62 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->open = nufs_open;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->read_buf = nufs_read_buf;
+  ops->write_buf = nufs_write_buf;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+// nufs-specific -o options, the rest are passed on to FUSE
+#define NUFS_OPT(t, p, v) { t, offsetof(nufs_options, p), v }
+static struct fuse_opt nufs_opts[] = {
+  NUFS_OPT("dedup", dedup, 1),
+  NUFS_OPT("compress", compress, 1),
+  NUFS_OPT("discard", discard, 1),
+  NUFS_OPT("populate", populate, 1),
+  NUFS_OPT("hugepages", hugepages, 1),
+  NUFS_OPT("prefault", prefault, 1),
+  NUFS_OPT("sequential", advice, MADV_SEQUENTIAL),
+  NUFS_OPT("random", advice, MADV_RANDOM),
+  NUFS_OPT("strictatime", atime, ATIME_STRICT),
+  NUFS_OPT("relatime", atime, ATIME_RELATIME),
+  NUFS_OPT("noatime", atime, ATIME_NOATIME),
+  NUFS_OPT("trace=%s", trace, 0),
+  NUFS_OPT("trace_records=%d", trace_records, 0),
+  FUSE_OPT_END
+};
+
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
-  storage_init(argv[--argc]);
+  assert(argc > 2);
+  const char *image = argv[--argc];
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &options, nufs_opts, NULL) == -1) {
+    return 1;
+  }
+
+  // Without big_writes the kernel splits writes into 4K pieces whatever the page
+  // size, and the splice options let read_buf and write_buf avoid copies
+  fuse_opt_add_arg(&args, "-obig_writes,splice_read,splice_write,splice_move");
+
+  // Opened before FUSE changes to / so a relative path works, and the shared
+  // mapping is kept by the daemon
+  if (options.trace != 0) {
+    int rv = trace_open(options.trace, options.trace_records > 0 ? options.trace_records : 1);
+    printf("+ trace_open(%s) -> %d\n", options.trace, rv);
+    if (rv < 0) {
+      fprintf(stderr, "nufs: can't open trace %s: %s\n", options.trace, strerror(-rv));
+      return 1;
+    }
+  }
+
+  storage_init(image);
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
@@ -0,0 +1,15 @@
+#include "options.h"
+#include "trace.h"
+
+nufs_options options = {
+    .dedup = 0,
+    .compress = 0,
+    .discard = 0,
+    .populate = 0,
+    .hugepages = 0,
+    .prefault = 0,
+    .advice = 0,
+    .atime = ATIME_STRICT,
+    .trace = 0,
+    .trace_records = TRACE_DEFAULT_RECORDS,
+};
@@ -0,0 +1,24 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#define ATIME_STRICT 0 // every read updates the access time
+#define ATIME_RELATIME 1 // only if it's older than the last change or a day old
+#define ATIME_NOATIME 2 // reads never update it
+
+// Mount options, filled in from -o flags by nufs.c before storage_init
+typedef struct nufs_options {
+    int dedup; // share identical data pages when a written file is closed
+    int compress; // store written files LZ4-compressed when they are closed
+    int discard; // punch every freed page out of the image, not just long runs
+    int populate; // fault the whole image in when it is mapped
+    int hugepages; // ask for transparent huge pages on the image mapping
+    int prefault; // read the metadata pages in ahead of the first callback
+    int advice; // madvise hint for a file's pages while it is open, 0 for none
+    int atime; // ATIME_* policy for updating access times on reads
+    char* trace; // file to record every operation to, see trace.h, 0 for none
+    int trace_records; // how many records the trace keeps before wrapping
+} nufs_options;
+
+extern nufs_options options;
+
+#endif
@@ -4,77 +4,524 @@
 #include <string.h>
 
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "pages.h"
 #include "util.h"
 #include "bitmap.h"
+#include "dedup.h"
+#include "inode.h"
+#include "options.h"
+#include "rebuild.h"
+#include "stats.h"
 
-const int PAGE_COUNT = 256;
-const int NUFS_SIZE  = 4096 * 256; // 1MB
+int PAGE_SIZE = 4096;
+int PAGE_COUNT = 256;
 
-static int   pages_fd   = -1;
-static void* pages_base =  0;
+// The superblock sits at a fixed spot in page 0, the rest of the metadata is
+// placed by pages_layout. Images from before the geometry was recorded are 1MB
+// with 256 inodes, and get the same layout they always had.
+const int SUPERBLOCK_OFFSET = 2048;
+const int LEGACY_PAGE_SIZE = 4096;
+const int LEGACY_PAGE_COUNT = 256;
+const int LEGACY_INODE_COUNT = 256;
+
+const int PUNCH_MIN_PAGES = 16; // freed runs at least this long are released to the host
+
+// Pages are dealt out to the backing files a chunk at a time, so a run of pages
+// longer than a chunk is spread over several files. One file is one chunk.
+static int    stripe_fds[NUFS_MAX_STRIPES];
+static int    stripe_count = 1;
+static int    stripe_pages = 0;
+static int    tier_pages   = 0; // tiered images put the pages below this in the first file
+
+static void*  pages_base =  0;
+static size_t pages_size =  0;
+static int    next_free  =  1; // no free page below this one
+
+static struct rusage startUsage; // fault counts are reported relative to mount
+
+// Pages FUSE may still be splicing from. These live in memory only, a page freed
+// while pinned keeps its bitmap bit until the last unpin, and a crash in between
+// leaves it for the rebuild to free.
+static uint16_t* pins     = 0;
+static uint8_t*  deferred = 0; // freed while pinned
+
+// Page 0, the inode table and the root directory are touched by nearly every call
+static int
+metadata_pages()
+{
+    return get_superblock()->first_data_page + 1;
+}
+
+static int
+align_up(int value, int alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static int
+valid_page_size(int size)
+{
+    return size >= NUFS_MIN_PAGE_SIZE && size <= NUFS_MAX_PAGE_SIZE &&
+        (size & (size - 1)) == 0;
+}
 
 void
-pages_init(const char* path)
+pages_layout(superblock* sb)
 {
-    pages_fd = open(path, O_CREAT | O_RDWR, 0644);
-    assert(pages_fd != -1);
+    // Bitmaps, refcounts and the orphan list are packed in that order below the
+    // superblock when they fit, and from page 1 onwards when they don't
+    int pageBitmap = align_up((sb->page_count + 7) / 8, 32);
+    int inodeBitmap = align_up((sb->inode_count + 7) / 8, 32);
+    int refs = align_up(sb->page_count * sizeof(uint16_t), 32);
+    int orphans = sizeof(int) + sb->inode_count * sizeof(int);
 
-    int rv = ftruncate(pages_fd, NUFS_SIZE);
-    assert(rv == 0);
+    int start = 0;
+    if (pageBitmap + inodeBitmap + refs + orphans > SUPERBLOCK_OFFSET) {
+        start = sb->page_size;
+    }
+
+    sb->page_bitmap_offset = start;
+    sb->inode_bitmap_offset = start + pageBitmap;
+    sb->page_refs_offset = sb->inode_bitmap_offset + inodeBitmap;
+    sb->orphans_offset = sb->page_refs_offset + refs;
+
+    int end = sb->orphans_offset + orphans;
+    sb->inode_table_page = max(1, align_up(end, sb->page_size) / sb->page_size);
+    sb->first_data_page = sb->inode_table_page +
+        align_up(sb->inode_count * sizeof(inode), sb->page_size) / sb->page_size;
+}
+
+// Splits a comma-separated list of backing files, returns how many there were
+static int
+split_paths(char* paths, char** names)
+{
+    int count = 0;
+    char* save;
+    for (char* name = strtok_r(paths, ",", &save); name != 0;
+         name = strtok_r(0, ",", &save)) {
+        if (count == NUFS_MAX_STRIPES) {
+            return -1;
+        }
+        names[count++] = name;
+    }
+    return count;
+}
+
+// Tiers are sized exactly, striped files for the most chunks any of them holds
+static off_t
+backing_file_size(superblock* sb, int file)
+{
+    if (sb->tier_pages > 0) {
+        int pages = file == 0 ? sb->tier_pages : sb->page_count - sb->tier_pages;
+        return (off_t)pages * sb->page_size;
+    }
+
+    int stripes = max(sb->stripe_count, 1);
+    int chunkPages = stripes > 1 ? sb->stripe_pages : sb->page_count;
+    int chunks = (sb->page_count + chunkPages - 1) / chunkPages;
+    return (off_t)((chunks + stripes - 1) / stripes) * chunkPages * sb->page_size;
+}
+
+// Tiered images are two files with the metadata in the fast one, striped ones
+// need mappings for all of their chunks
+static int
+valid_backing(superblock* sb)
+{
+    if (sb->tier_pages > 0) {
+        return sb->stripe_count == 2 && sb->tier_pages > sb->first_data_page &&
+            sb->tier_pages < sb->page_count;
+    }
+
+    return sb->stripe_count >= 1 && sb->stripe_pages >= 1 &&
+        (sb->page_count + sb->stripe_pages - 1) / sb->stripe_pages <= NUFS_MAX_STRIPE_CHUNKS;
+}
+
+int
+pages_format(const char* paths, superblock* geometry)
+{
+    if (!valid_page_size(geometry->page_size)) {
+        return -EINVAL;
+    }
+
+    char* list = strdup(paths);
+    char* names[NUFS_MAX_STRIPES];
+    int stripes = split_paths(list, names);
+
+    // Only the superblock is written, pages_init sets up the rest on first use
+    superblock sb = *geometry;
+    sb.magic = 0;
+    sb.version = NUFS_VERSION;
+    sb.stripe_count = stripes;
+    if (stripes == 1 || sb.tier_pages > 0) {
+        sb.stripe_pages = sb.page_count;
+    }
+    pages_layout(&sb);
+
+    int rv = 0;
+    if (sb.first_data_page >= sb.page_count) {
+        rv = -ENOSPC;
+    } else if (!valid_backing(&sb)) {
+        rv = -EINVAL;
+    }
+
+    for (int ii = 0; rv == 0 && ii < stripes; ++ii) {
+        int fd = open(names[ii], O_CREAT | O_TRUNC | O_RDWR, 0644);
+        if (fd == -1) {
+            rv = -errno;
+            break;
+        }
+
+        // The superblock lives in page 0, which is always in the first file
+        if (ftruncate(fd, backing_file_size(&sb, ii)) != 0 ||
+            (ii == 0 && pwrite(fd, &sb, sizeof(sb), SUPERBLOCK_OFFSET) != sizeof(sb))) {
+            rv = -errno;
+        }
+        close(fd);
+    }
+
+    free(list);
+    return rv;
+}
+
+// Which file holds a page and where: whole chunks are dealt out round-robin
+static int
+stripe_of(int pnum, off_t* pos)
+{
+    if (tier_pages > 0) {
+        int slow = pnum >= tier_pages;
+        *pos = (off_t)(pnum - slow * tier_pages) * PAGE_SIZE;
+        return slow;
+    }
+
+    int chunk = pnum / stripe_pages;
+    *pos = ((off_t)(chunk / stripe_count) * stripe_pages + pnum % stripe_pages) * PAGE_SIZE;
+    return chunk % stripe_count;
+}
+
+// The first page after pnum that doesn't follow it in the same file
+static int
+chunk_end(int pnum)
+{
+    if (tier_pages > 0) {
+        return pnum < tier_pages ? tier_pages : PAGE_COUNT;
+    }
+    return min((pnum / stripe_pages + 1) * stripe_pages, PAGE_COUNT);
+}
+
+// Opens the backing files, the first is created if it's missing like before
+static void
+open_stripes(const char* paths, superblock* sb)
+{
+    char* list = strdup(paths);
+    char* names[NUFS_MAX_STRIPES];
+    int count = split_paths(list, names);
+    assert(count >= 1);
+
+    stripe_fds[0] = open(names[0], O_CREAT | O_RDWR, 0644);
+    assert(stripe_fds[0] != -1);
+
+    memset(sb, 0, sizeof(*sb));
+    int rv = pread(stripe_fds[0], sb, sizeof(*sb), SUPERBLOCK_OFFSET);
+    assert(rv >= 0);
+
+    // Nothing in the other files says which image they belong to, so the best
+    // that can be checked is that the same number were given
+    stripe_count = max(sb->stripe_count, 1);
+    if (count != stripe_count) {
+        fprintf(stderr, "nufs: %s is striped over %d files, got %d\n",
+                names[0], stripe_count, count);
+        exit(1);
+    }
+
+    for (int ii = 1; ii < count; ++ii) {
+        stripe_fds[ii] = open(names[ii], O_RDWR);
+        if (stripe_fds[ii] == -1) {
+            perror(names[ii]);
+            exit(1);
+        }
+    }
+
+    free(list);
+}
+
+void
+pages_map(const char* paths)
+{
+    // The geometry has to be known before the image can be mapped
+    superblock sb;
+    open_stripes(paths, &sb);
+
+    int legacy = sb.version < NUFS_VERSION;
+    if (legacy) {
+        sb.page_size = LEGACY_PAGE_SIZE;
+        sb.page_count = LEGACY_PAGE_COUNT;
+        sb.inode_count = LEGACY_INODE_COUNT;
+        sb.dir_format = 0;
+        pages_layout(&sb);
+    }
+    assert(valid_page_size(sb.page_size));
 
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
+    PAGE_SIZE = sb.page_size;
+    PAGE_COUNT = sb.page_count;
+    INODE_COUNT = sb.inode_count;
+    pages_size = (size_t)PAGE_COUNT * PAGE_SIZE;
+    stripe_pages = stripe_count > 1 ? sb.stripe_pages : PAGE_COUNT;
+    tier_pages = sb.tier_pages;
+    assert(stripe_pages > 0);
+
+    // Only ever extend, which leaves a hole rather than allocating the whole image
+    for (int ii = 0; ii < stripe_count; ++ii) {
+        off_t fileSize = backing_file_size(&sb, ii);
+        struct stat st;
+        int rv = fstat(stripe_fds[ii], &st);
+        assert(rv == 0);
+        if (st.st_size < fileSize) {
+            rv = ftruncate(stripe_fds[ii], fileSize);
+            assert(rv == 0);
+        }
+    }
+
+    getrusage(RUSAGE_SELF, &startUsage);
+
+    // Reserve the whole range, then map each chunk over its place in it so that
+    // pages stay at base + pnum * PAGE_SIZE however they're spread
+    pages_base = mmap(0, pages_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                      -1, 0);
     assert(pages_base != MAP_FAILED);
 
+    int flags = MAP_SHARED | MAP_FIXED | (options.populate ? MAP_POPULATE : 0);
+    for (int first = 0; first < PAGE_COUNT; first = chunk_end(first)) {
+        off_t pos;
+        int file = stripe_of(first, &pos);
+        size_t length = (size_t)(chunk_end(first) - first) * PAGE_SIZE;
+        void* chunk = mmap(pages_get_page(first), length, PROT_READ | PROT_WRITE, flags,
+                           stripe_fds[file], pos);
+        assert(chunk != MAP_FAILED);
+    }
+
+    if (legacy) {
+        superblock* onDisk = get_superblock();
+        sb.magic = onDisk->magic;
+        sb.free_pages = onDisk->free_pages;
+        sb.free_inodes = onDisk->free_inodes;
+        sb.clean = onDisk->clean;
+        sb.version = NUFS_VERSION;
+        *onDisk = sb;
+    }
+
+    // Both are hints, so a kernel that can't honor them just leaves 4K pages
+    if (options.hugepages) {
+        pages_advise(0, PAGE_COUNT, MADV_HUGEPAGE);
+    }
+    if (options.prefault) {
+        pages_advise(0, metadata_pages(), MADV_WILLNEED);
+    }
+}
+
+// Bitmaps used to be indexed by byte rather than by bit. Pages 1 to 5 (the
+// inode table and the root directory) are always in use, so a bit-indexed map
+// has them all in its first byte, while a byte-indexed one gives each its own.
+static int
+has_byte_bitmaps()
+{
+    uint8_t* pbm = get_pages_bitmap();
+    return pbm[0] == 1 && pbm[1] == 1;
+}
+
+// The old maps overlapped each other and what are now the refcounts, so only the
+// inode table can be trusted. Inodes in use are the ones with a mode, and the
+// page bitmap and refcounts are left for the rebuild to count from them.
+static void
+migrate_byte_bitmaps()
+{
+    superblock* sb = get_superblock();
+    uint8_t* page0 = pages_get_page(0);
+    memset(page0 + sb->page_bitmap_offset, 0, sb->orphans_offset - sb->page_bitmap_offset);
+
+    void* ibm = get_inode_bitmap();
+    inode* table = pages_get_page(sb->inode_table_page);
+    int count = 0;
+    for (int ii = 0; ii < INODE_COUNT; ++ii) {
+        if (table[ii].mode != 0) {
+            bitmap_put(ibm, ii, 1);
+            count++;
+        }
+    }
+
+    printf("+ migrate_byte_bitmaps() -> %d inodes\n", count);
+}
+
+int
+pages_init(const char* paths)
+{
+    pages_map(paths);
+
     void* pbm = get_pages_bitmap();
-    bitmap_put(pbm, 0, 1);
+
+    // New image or one from before the superblock, reserve the metadata pages
+    // if that hasn't happened yet and count free space once
+    superblock* sb = get_superblock();
+    int dirty = 0;
+    if (sb->magic != NUFS_MAGIC) {
+        if (has_byte_bitmaps()) {
+            migrate_byte_bitmaps();
+            dirty = 1;
+        }
+
+        for (int ii = 0; ii < sb->first_data_page; ++ii) {
+            page_set_refs(ii, 1);
+        }
+
+        sb->free_pages = 0;
+        for (int ii = 0; ii < PAGE_COUNT; ++ii) {
+            sb->free_pages += !bitmap_get(pbm, ii);
+        }
+
+        void* ibm = get_inode_bitmap();
+        sb->free_inodes = 0;
+        for (int ii = 0; ii < INODE_COUNT; ++ii) {
+            sb->free_inodes += !bitmap_get(ibm, ii);
+        }
+
+        sb->magic = NUFS_MAGIC;
+    } else {
+        dirty = !sb->clean;
+    }
+
+    // Stays cleared until pages_mark_clean, so a crash is noticed next mount
+    sb->clean = 0;
+    int rv = msync(pages_base, PAGE_SIZE, MS_SYNC);
+    assert(rv == 0);
+
+    return dirty;
+}
+
+void
+pages_mark_clean()
+{
+    pages_sync();
+
+    get_superblock()->clean = 1;
+    int rv = msync(pages_base, PAGE_SIZE, MS_SYNC);
+    assert(rv == 0);
+}
+
+static void*
+sync_stripe(void* arg)
+{
+    int rv = fdatasync(*(int*)arg);
+    assert(rv == 0);
+    return 0;
+}
+
+void
+pages_sync()
+{
+    if (stripe_count == 1) {
+        int rv = msync(pages_base, pages_size, MS_SYNC);
+        assert(rv == 0);
+        return;
+    }
+
+    // Each file is flushed by its own thread so that every device writes at once
+    pthread_t threads[NUFS_MAX_STRIPES];
+    for (int ii = 0; ii < stripe_count; ++ii) {
+        int rv = pthread_create(&threads[ii], 0, sync_stripe, &stripe_fds[ii]);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < stripe_count; ++ii) {
+        pthread_join(threads[ii], 0);
+    }
 }
 
 void
 pages_free()
 {
-    int rv = munmap(pages_base, NUFS_SIZE);
+    int rv = munmap(pages_base, pages_size);
     assert(rv == 0);
 }
 
 void*
 pages_get_page(int pnum)
 {
-    return pages_base + PAGE_SIZE * pnum;
+    return pages_base + (size_t)PAGE_SIZE * pnum;
+}
+
+int
+pages_locate(int pnum, off_t* pos)
+{
+    return stripe_fds[stripe_of(pnum, pos)];
 }
 
 void*
 get_pages_bitmap()
 {
-    return pages_get_page(0);
+    return pages_base + get_superblock()->page_bitmap_offset;
 }
 
 void*
 get_inode_bitmap()
 {
-    uint8_t* page = pages_get_page(0);
-    return (void*)(page + 32);
+    return pages_base + get_superblock()->inode_bitmap_offset;
 }
 
-int
-alloc_page()
+superblock*
+get_superblock()
+{
+    return (superblock*)(pages_base + SUPERBLOCK_OFFSET);
+}
+
+void*
+get_orphan_list()
+{
+    return pages_base + get_superblock()->orphans_offset;
+}
+
+static uint16_t*
+get_page_refs()
+{
+    return (uint16_t*)(pages_base + get_superblock()->page_refs_offset);
+}
+
+static void
+claim_page(int pnum)
+{
+    bitmap_put(get_pages_bitmap(), pnum, 1);
+    get_page_refs()[pnum] = 1;
+    get_superblock()->free_pages--;
+    memset(pages_get_page(pnum), 0, PAGE_SIZE);
+}
+
+static int
+find_free_page()
 {
     void* pbm = get_pages_bitmap();
+    superblock* sb = get_superblock();
 
-    for (int ii = 1; ii < PAGE_COUNT; ++ii) {
+    // Full, no need to scan the bitmap to find out
+    if (sb->free_pages <= 0) {
+        return -1;
+    }
+
+    // Search from the hint first, then wrap around in case it was stale
+    for (int nn = 0; nn < PAGE_COUNT - 1; ++nn) {
+        int ii = 1 + (next_free - 1 + nn) % (PAGE_COUNT - 1);
+        rebuild_check(ii);
         if (!bitmap_get(pbm, ii)) {
-            bitmap_put(pbm, ii, 1);
-            void* newPage = pages_get_page(ii);
-            memset(newPage, 0, PAGE_SIZE);
+            claim_page(ii);
+            next_free = ii + 1 < PAGE_COUNT ? ii + 1 : 1;
             printf("+ alloc_page() -> %d\n", ii);
             return ii;
         }
@@ -83,11 +530,338 @@ alloc_page()
     return -1;
 }
 
+int
+alloc_page()
+{
+    uint64_t start = stats_begin();
+    int pnum = find_free_page();
+    stats_end(STATS_ALLOC_PAGE, start);
+    return pnum;
+}
+
+int
+alloc_page_in(int first, int end)
+{
+    // Used to place pages on purpose, so the allocation hint is left alone
+    void* pbm = get_pages_bitmap();
+    for (int ii = max(first, 1); ii < min(end, PAGE_COUNT); ++ii) {
+        rebuild_check(ii);
+        if (!bitmap_get(pbm, ii)) {
+            claim_page(ii);
+            printf("+ alloc_page_in(%d, %d) -> %d\n", first, end, ii);
+            return ii;
+        }
+    }
+
+    return -1;
+}
+
+// Gives a run of freed pages back to the host filesystem so the image stays sparse
+static void
+punch_pages(int start, int count)
+{
+    // A run is contiguous in a file only up to the end of its chunk
+    while (count > 0) {
+        off_t pos;
+        int fd = pages_locate(start, &pos);
+        int run = min(count, chunk_end(start) - start);
+
+        int rv = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           pos, (off_t)run * PAGE_SIZE);
+        if (rv != 0) {
+            perror("fallocate");
+        }
+
+        start += run;
+        count -= run;
+    }
+}
+
+static void
+release_run(int start, int count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    bitmap_clear_range(get_pages_bitmap(), start, count);
+    get_superblock()->free_pages += count;
+    if (count >= PUNCH_MIN_PAGES || options.discard) {
+        punch_pages(start, count);
+    }
+}
+
+static int
+compare_ints(const void* aa, const void* bb)
+{
+    return *(const int*)aa - *(const int*)bb;
+}
+
+void
+free_pages(int* pnums, int count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    uint16_t* refs = get_page_refs();
+    qsort(pnums, count, sizeof(int), compare_ints);
+
+    // Walk the sorted pages, clearing each run of newly freed pages at once
+    int runStart = 0;
+    int runLength = 0;
+    int freed = 0;
+    int rebuiltGroup = -1;
+
+    for (int ii = 0; ii < count; ii++) {
+        int pnum = pnums[ii];
+
+        // The callers have already dropped their pointers, so a group rebuilt
+        // from the inode table now has these references released already
+        if (rebuild_check(pnum)) {
+            rebuiltGroup = pnum / REBUILD_GROUP_PAGES;
+        }
+        if (pnum / REBUILD_GROUP_PAGES == rebuiltGroup) {
+            continue;
+        }
+
+        int pageRefs = page_refs(pnum);
+
+        if (pageRefs > 1) {
+            refs[pnum]--;
+            continue;
+        } else if (pageRefs == 0) {
+            continue;
+        }
+
+        refs[pnum] = 0;
+        dedup_forget(pnum);
+        freed++;
+
+        if (pins != 0 && pins[pnum] > 0) {
+            deferred[pnum] = 1;
+            continue;
+        }
+
+        if (runLength > 0 && pnum == runStart + runLength) {
+            runLength++;
+        } else {
+            release_run(runStart, runLength);
+            runStart = pnum;
+            runLength = 1;
+        }
+    }
+
+    release_run(runStart, runLength);
+
+    if (pnums[0] < next_free) {
+        next_free = pnums[0];
+    }
+
+    printf("+ free_pages(%d) -> %d freed\n", count, freed);
+}
+
+// Gives back a page whose last reference was dropped, or defers that while it's pinned
+static void
+release_page(int pnum)
+{
+    if (pins != 0 && pins[pnum] > 0) {
+        deferred[pnum] = 1;
+        return;
+    }
+
+    bitmap_put(get_pages_bitmap(), pnum, 0);
+    get_superblock()->free_pages++;
+
+    if (options.discard) {
+        punch_pages(pnum, 1);
+    }
+
+    if (pnum < next_free) {
+        next_free = pnum;
+    }
+}
+
 void
 free_page(int pnum)
 {
     printf("+ free_page(%d)\n", pnum);
+    uint16_t* refs = get_page_refs();
+
+    // Already free, counting it again would throw off the free page count
+    int pageRefs = page_refs(pnum);
+    if (pageRefs == 0) {
+        return;
+    }
+
+    // Shared pages stay allocated until their last reference is dropped
+    if (pageRefs > 1) {
+        refs[pnum]--;
+        return;
+    }
+
+    refs[pnum] = 0;
+    dedup_forget(pnum);
+    release_page(pnum);
+}
+
+void
+pages_pin(int pnum)
+{
+    if (pins == 0) {
+        pins = calloc(PAGE_COUNT, sizeof(uint16_t));
+        deferred = calloc(PAGE_COUNT, 1);
+    }
+
+    pins[pnum]++;
+}
+
+void
+pages_unpin(int pnum)
+{
+    if (pins == 0 || pins[pnum] == 0) {
+        return;
+    }
+
+    pins[pnum]--;
+    if (pins[pnum] == 0 && deferred[pnum]) {
+        deferred[pnum] = 0;
+        release_page(pnum);
+    }
+}
+
+void
+pages_unpin_all()
+{
+    for (int ii = 0; pins != 0 && ii < PAGE_COUNT; ii++) {
+        if (pins[ii] > 0) {
+            pins[ii] = 1;
+            pages_unpin(ii);
+        }
+    }
+}
+
+int
+pages_trim(int start, int count, int min_run)
+{
+    void* pbm = get_pages_bitmap();
+    int end = min(start + count, PAGE_COUNT);
+    int trimmed = 0;
+
+    for (int ii = max(start, 1); ii < end; ++ii) {
+        rebuild_check(ii);
+    }
+
+    for (int ii = max(start, 1); ii < end;) {
+        if (bitmap_get(pbm, ii)) {
+            ii++;
+            continue;
+        }
+
+        int run = 1;
+        while (ii + run < end && !bitmap_get(pbm, ii + run)) {
+            run++;
+        }
+
+        if (run >= min_run) {
+            punch_pages(ii, run);
+            trimmed += run;
+        }
+        ii += run;
+    }
+
+    printf("+ pages_trim(%d, %d) -> %d\n", start, count, trimmed);
+    return trimmed;
+}
+
+void
+pages_advise(int pnum, int count, int advice)
+{
+    int rv = madvise(pages_get_page(pnum), (size_t)count * PAGE_SIZE, advice);
+    if (rv != 0) {
+        perror("madvise");
+    }
+}
+
+pages_stats
+pages_get_stats()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    pages_stats stats;
+    stats.minor_faults = usage.ru_minflt - startUsage.ru_minflt;
+    stats.major_faults = usage.ru_majflt - startUsage.ru_majflt;
+    return stats;
+}
+
+int
+page_refs(int pnum)
+{
+    rebuild_check(pnum);
+    if (!bitmap_get(get_pages_bitmap(), pnum) || (deferred != 0 && deferred[pnum])) {
+        return 0;
+    }
+
+    // Pages allocated before refcounts existed count as singly owned
+    int refs = get_page_refs()[pnum];
+    return refs > 0 ? refs : 1;
+}
+
+int
+page_share(int pnum)
+{
+    // The count would wrap around, callers copy the page instead
+    int pageRefs = page_refs(pnum);
+    if (pageRefs >= UINT16_MAX) {
+        return -1;
+    }
+
+    get_page_refs()[pnum] = pageRefs + 1;
+    return 0;
+}
+
+void
+page_set_refs(int pnum, int refs)
+{
     void* pbm = get_pages_bitmap();
-    bitmap_put(pbm, pnum, 0);
+    int wasUsed = bitmap_get(pbm, pnum);
+
+    if (refs == 0) {
+        dedup_forget(pnum);
+    }
+
+    // Nothing points at a pinned page any more, but it stays allocated for now
+    if (refs == 0 && wasUsed && pins != 0 && pins[pnum] > 0) {
+        get_page_refs()[pnum] = 0;
+        deferred[pnum] = 1;
+        return;
+    }
+
+    bitmap_put(pbm, pnum, refs > 0);
+    get_page_refs()[pnum] = refs;
+    get_superblock()->free_pages += wasUsed - (refs > 0);
+
+    if (refs == 0 && pnum < next_free) {
+        next_free = pnum;
+    }
+}
+
+int
+page_unshare(int pnum)
+{
+    if (page_refs(pnum) <= 1) {
+        return pnum;
+    }
+
+    int copy = alloc_page();
+    if (copy < 0) {
+        return -1;
+    }
+
+    memcpy(pages_get_page(copy), pages_get_page(pnum), PAGE_SIZE);
+    free_page(pnum);
+    printf("+ page_unshare(%d) -> %d\n", pnum, copy);
+    return copy;
 }
 
@@ -3,16 +3,83 @@
 #ifndef PAGES_H
 #define PAGES_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
-const static int PAGE_SIZE = 4096;
+extern int PAGE_SIZE; // from the superblock, set by pages_map
+extern int PAGE_COUNT;
 
-void pages_init(const char* path);
+#define NUFS_MIN_PAGE_SIZE 4096 // page sizes are powers of two in this range
+#define NUFS_MAX_PAGE_SIZE (256 * 1024)
+
+#define NUFS_MAX_STRIPES 16 // backing files an image can be spread over
+#define NUFS_MAX_STRIPE_CHUNKS 32768 // every chunk is its own mapping
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 1 // superblocks from before this have version 0 and the 1MB geometry
+
+// Filesystem-wide state kept in page 0
+typedef struct superblock {
+    uint32_t magic; // NUFS_MAGIC once the counters below have been set up
+    int32_t free_pages; // kept up to date by alloc_page and free_page(s)
+    int32_t free_inodes; // kept up to date by alloc_inode and free_inode
+    int32_t clean; // set on unmount, cleared while mounted
+    int32_t version; // NUFS_VERSION once the geometry below has been filled in
+    // Geometry, chosen by nufs-mkfs
+    int32_t page_size;
+    int32_t page_count;
+    int32_t inode_count;
+    int32_t dir_format; // DIR_FORMAT_* of every directory page
+    // Layout, worked out from the geometry by pages_layout
+    int32_t page_bitmap_offset; // byte offsets from the start of the image
+    int32_t inode_bitmap_offset;
+    int32_t page_refs_offset;
+    int32_t orphans_offset;
+    int32_t inode_table_page;
+    int32_t first_data_page; // the root directory's page, everything below is metadata
+    // Striping, both 0 in images made before it existed
+    int32_t stripe_count; // backing files, listed comma-separated wherever a path is taken
+    int32_t stripe_pages; // pages per chunk, consecutive chunks go to consecutive files
+    int32_t tier_pages; // pages in the fast first file of a two-file tiered image, or 0
+} superblock;
+
+// Page faults taken by the whole process since pages_init
+typedef struct pages_stats {
+    int64_t minor_faults;
+    int64_t major_faults;
+} pages_stats;
+
+void pages_layout(superblock* sb); // fills in the layout for sb's geometry
+int pages_format(const char* paths, superblock* geometry); // creates an empty image
+void pages_map(const char* paths); // maps the image without setting anything up, for tools
+int pages_init(const char* paths); // returns 1 if the image wasn't cleanly unmounted
+void pages_mark_clean();
+void pages_sync(); // writes back the whole image, every backing file at once
 void pages_free();
 void* pages_get_page(int pnum);
+int pages_locate(int pnum, off_t* pos); // returns the file holding pnum, sets its offset there
 void* get_pages_bitmap();
 void* get_inode_bitmap();
+void* get_orphan_list();
+superblock* get_superblock();
 int alloc_page();
+int alloc_page_in(int first, int end); // the lowest free page in [first, end), or -1
 void free_page(int pnum);
+void free_pages(int* pnums, int count); // sorts pnums
+int pages_trim(int start, int count, int min_run); // punches free runs, returns pages punched
+void pages_advise(int pnum, int count, int advice); // madvise on a run of pages
+void pages_pin(int pnum); // keeps a page from being reused, even once it's freed
+void pages_unpin(int pnum);
+void pages_unpin_all(); // for unmounting, once nothing is reading from the image
+pages_stats pages_get_stats();
+
+// Copy-on-write sharing: pages are freed once their last reference is dropped,
+// and page_unshare returns a private copy of a page that has other owners.
+// page_share returns -1 once a page has as many references as can be counted.
+int page_refs(int pnum);
+int page_share(int pnum);
+int page_unshare(int pnum);
+void page_set_refs(int pnum, int refs); // for rebuilding, 0 frees the page
 
 #endif
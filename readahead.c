@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "inode.h"
+#include "pages.h"
+#include "util.h"
+
+#include "readahead.h"
+
+static readahead_stats stats;
+
+void readahead_reset(readahead_state* ra) {
+  ra->next = 0;
+  ra->issued = 0;
+  ra->window = 0;
+}
+
+void readahead_access(readahead_state* ra, int inum, off_t offset, size_t size) {
+  if (offset != ra->next) {
+    // A seek, stop prefetching until the reader settles into a new stream
+    ra->window = 0;
+    ra->issued = 0;
+  } else if (ra->window == 0) {
+    ra->window = READAHEAD_MIN_PAGES;
+    stats.streams++;
+  } else {
+    ra->window = min(ra->window * 2, READAHEAD_MAX_PAGES);
+  }
+  ra->next = offset + size;
+
+  inode* node = get_inode(inum);
+  if (ra->window == 0 || (node->flags & INODE_COMPRESSED)) {
+    return;
+  }
+
+  // Top the window up once the reader has used half of it, so the hints stay
+  // ahead of it instead of being issued on every read
+  off_t target = ra->next + (off_t)ra->window * PAGE_SIZE;
+  off_t start = ra->issued > ra->next ? ra->issued : ra->next;
+  if (target - start < (off_t)ra->window * PAGE_SIZE / 2 || start >= node->size) {
+    return;
+  }
+
+  int firstPage = start / PAGE_SIZE;
+  int lastPage = bytes_to_pages(target < node->size ? target : node->size);
+  int advised = inode_advise(node, firstPage, lastPage - firstPage, MADV_WILLNEED);
+  ra->issued = (off_t)lastPage * PAGE_SIZE;
+  stats.pages_prefetched += advised;
+
+  printf("+ readahead_access(%d, %ld) -> %d pages\n", inum, offset, advised);
+}
+
+readahead_stats readahead_get_stats() {
+  return stats;
+}
@@ -0,0 +1,48 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define READAHEAD_MIN_PAGES 4 // window after the first sequential read
+#define READAHEAD_MAX_PAGES 64 // the window stops doubling here
+
+// Access pattern of one open file, kept in its fuse_file_info
+typedef struct readahead_state {
+    off_t next; // where a sequential reader would read next
+    off_t issued; // prefetch has been requested up to here
+    int window; // pages to keep ahead of the reader, 0 when not sequential
+} readahead_state;
+
+typedef struct readahead_stats {
+    int64_t streams; // times an open file was detected reading sequentially
+    int64_t pages_prefetched; // pages hinted with MADV_WILLNEED
+} readahead_stats;
+
+/**
+ * @brief Sets up the state for a newly opened file.
+ * 
+ * @param ra the state to reset
+ */
+void readahead_reset(readahead_state* ra);
+
+/**
+ * @brief Records a read and, when the file is being read sequentially, asks the
+ *        kernel to start loading the next window of its pages. The window doubles
+ *        with every sequential read and collapses on a seek.
+ * 
+ * @param ra the open file's state
+ * @param inum the index of the file's inode
+ * @param offset where the read started
+ * @param size the number of bytes read
+ */
+void readahead_access(readahead_state* ra, int inum, off_t offset, size_t size);
+
+/**
+ * @brief Gets the readahead counters.
+ * 
+ * @return readahead_stats the totals since mount
+ */
+readahead_stats readahead_get_stats();
+
+#endif
@@ -0,0 +1,128 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitmap.h"
+#include "inode.h"
+#include "pages.h"
+#include "storage.h"
+#include "util.h"
+
+#include "rebuild.h"
+
+static uint8_t* pending = 0; // one flag per group, 0 when nothing is pending
+static int pendingCount = 0;
+
+static pthread_t thread;
+static int running = 0;
+
+static int group_count() {
+  return (PAGE_COUNT + REBUILD_GROUP_PAGES - 1) / REBUILD_GROUP_PAGES;
+}
+
+void rebuild_begin() {
+  free(pending);
+  pending = malloc(group_count());
+  for (int gg = 0; gg < group_count(); gg++) {
+    pending[gg] = 1;
+  }
+  pendingCount = group_count();
+
+  // The counters may not match the bitmaps after a crash. The inode bitmap is taken
+  // as the truth, while the free page count is corrected group by group later.
+  superblock* sb = get_superblock();
+  void* ibm = get_inode_bitmap();
+  sb->free_inodes = 0;
+  for (int ii = 0; ii < INODE_COUNT; ii++) {
+    sb->free_inodes += !bitmap_get(ibm, ii);
+  }
+
+  void* pbm = get_pages_bitmap();
+  sb->free_pages = 0;
+  for (int ii = 0; ii < PAGE_COUNT; ii++) {
+    sb->free_pages += !bitmap_get(pbm, ii);
+  }
+
+  printf("+ rebuild_begin() -> %d groups\n", pendingCount);
+}
+
+// Recounts the references to each page in a group from every allocated inode
+static void rebuild_group(int group) {
+  int start = group * REBUILD_GROUP_PAGES;
+  int end = min(start + REBUILD_GROUP_PAGES, PAGE_COUNT);
+  int firstData = get_superblock()->first_data_page;
+  int refs[REBUILD_GROUP_PAGES] = {0};
+
+  pending[group] = 0;
+  pendingCount--;
+
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    inode* node = get_inode(inum);
+    if (node == 0) {
+      continue;
+    }
+
+    for (int ii = 0; ii < 5; ii++) {
+      int pnum = node->ptrs[ii];
+      if (pnum >= start && pnum < end) {
+        refs[pnum - start]++;
+      }
+    }
+  }
+
+  // The metadata pages aren't pointed to by anything
+  for (int pnum = start; pnum < end; pnum++) {
+    int count = refs[pnum - start];
+    page_set_refs(pnum, pnum < firstData ? 1 : count);
+  }
+
+  printf("+ rebuild_group(%d) -> %d left\n", group, pendingCount);
+}
+
+int rebuild_check(int pnum) {
+  if (pendingCount == 0) {
+    return 0;
+  }
+
+  int group = pnum / REBUILD_GROUP_PAGES;
+  if (!pending[group]) {
+    return 0;
+  }
+
+  rebuild_group(group);
+  return 1;
+}
+
+int rebuild_run(int max) {
+  for (int gg = 0; gg < group_count() && pendingCount > 0 && max != 0; gg++) {
+    if (pending[gg]) {
+      rebuild_group(gg);
+      max--;
+    }
+  }
+
+  return pendingCount;
+}
+
+static void* rebuild_thread(void* arg) {
+  // One group per hold of the storage lock, so FUSE callbacks get it in between
+  int left;
+  do {
+    storage_lock();
+    left = rebuild_run(1);
+    storage_unlock();
+  } while (left > 0 && running);
+
+  return 0;
+}
+
+void rebuild_start() {
+  running = 1;
+  pthread_create(&thread, 0, rebuild_thread, 0);
+}
+
+void rebuild_stop() {
+  running = 0;
+  pthread_join(thread, 0);
+}
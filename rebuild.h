@@ -0,0 +1,39 @@
+#ifndef REBUILD_H
+#define REBUILD_H
+
+#define REBUILD_GROUP_PAGES 64 // pages whose bitmap bits and refcounts are rebuilt together
+
+/**
+ * @brief Marks every allocation group as untrusted after an unclean unmount. Each
+ *        group's page bitmap and refcounts are recomputed from the inode table the
+ *        first time it is used, or earlier by the background thread.
+ */
+void rebuild_begin();
+
+/**
+ * @brief Rebuilds the group holding a page if that hasn't happened yet.
+ * 
+ * @param pnum the page about to be used
+ * @return int 1 if the group was rebuilt just now, 0 if it was already trusted
+ */
+int rebuild_check(int pnum);
+
+/**
+ * @brief Rebuilds groups that haven't been used yet.
+ * 
+ * @param max the most groups to rebuild, or -1 for all of them
+ * @return int the number of groups still untrusted
+ */
+int rebuild_run(int max);
+
+/**
+ * @brief Starts the background thread that rebuilds the remaining groups.
+ */
+void rebuild_start();
+
+/**
+ * @brief Stops the background thread, leaving any remaining groups untrusted.
+ */
+void rebuild_stop();
+
+#endif
@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "directory.h"
+#include "inode.h"
+#include "pages.h"
+#include "storage.h"
+#include "util.h"
+
+#include "reclaim.h"
+
+const int RECLAIM_BATCH = 16; // inodes freed per hold of the storage lock
+
+typedef struct orphan_list {
+  int count;
+  int inums[]; // INODE_COUNT slots, every orphan is a distinct inode so it can't overflow
+} orphan_list;
+
+static pthread_t thread;
+static pthread_mutex_t wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static int wakeups = 0;
+static int running = 0;
+
+static void wake() {
+  pthread_mutex_lock(&wakeMutex);
+  wakeups = 1;
+  pthread_cond_signal(&wakeCond);
+  pthread_mutex_unlock(&wakeMutex);
+}
+
+void reclaim_detach(int inum) {
+  orphan_list* orphans = get_orphan_list();
+  orphans->inums[orphans->count++] = inum;
+  printf("+ reclaim_detach(%d) -> %d queued\n", inum, orphans->count);
+  wake();
+}
+
+// Queues a directory's children, dropping a link from those linked elsewhere
+static int detach_entry(const char* name, int inum, void* arg) {
+  if (!streq(name, ".") && !streq(name, "..")) {
+    inode* node = get_inode(inum);
+    if (node->refs > 0) {
+      node->refs--;
+    } else {
+      orphan_list* orphans = get_orphan_list();
+      orphans->inums[orphans->count++] = inum;
+    }
+  }
+  return 0;
+}
+
+int reclaim_run(int max) {
+  orphan_list* orphans = get_orphan_list();
+
+  for (int freed = 0; orphans->count > 0 && freed != max; freed++) {
+    int inum = orphans->inums[--orphans->count];
+    inode* node = get_inode(inum);
+
+    if (node != 0) {
+      if (is_folder(node->mode)) {
+        directory_foreach(node, detach_entry, 0);
+      }
+      free_inode(inum);
+    }
+  }
+
+  return orphans->count;
+}
+
+int reclaim_pending() {
+  return ((orphan_list*)get_orphan_list())->count;
+}
+
+static void* reclaim_thread(void* arg) {
+  while (1) {
+    pthread_mutex_lock(&wakeMutex);
+    while (!wakeups && running) {
+      pthread_cond_wait(&wakeCond, &wakeMutex);
+    }
+    wakeups = 0;
+    int stop = !running;
+    pthread_mutex_unlock(&wakeMutex);
+
+    if (stop) {
+      return 0;
+    }
+
+    // Free in small batches so FUSE callbacks can get the lock in between
+    int pending;
+    do {
+      storage_lock();
+      pending = reclaim_run(RECLAIM_BATCH);
+      storage_unlock();
+    } while (pending > 0 && running);
+  }
+}
+
+void reclaim_start() {
+  running = 1;
+  wakeups = 1; // finish anything left over from before the last unmount or crash
+  pthread_create(&thread, 0, reclaim_thread, 0);
+}
+
+void reclaim_stop() {
+  pthread_mutex_lock(&wakeMutex);
+  running = 0;
+  pthread_cond_signal(&wakeCond);
+  pthread_mutex_unlock(&wakeMutex);
+  pthread_join(thread, 0);
+}
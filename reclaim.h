@@ -0,0 +1,37 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+/**
+ * @brief Queues an unlinked inode to be freed in the background. The queue lives in
+ *        page 0, so freeing picks up where it left off after a crash.
+ * 
+ * @param inum the index of the inode, which must no longer be linked anywhere
+ */
+void reclaim_detach(int inum);
+
+/**
+ * @brief Frees queued inodes, including everything below queued directories.
+ * 
+ * @param max the most inodes to free, or -1 to empty the queue
+ * @return int the number of inodes still queued
+ */
+int reclaim_run(int max);
+
+/**
+ * @brief Gets the number of inodes waiting to be freed.
+ * 
+ * @return int the queue length
+ */
+int reclaim_pending();
+
+/**
+ * @brief Starts the background thread that empties the queue.
+ */
+void reclaim_start();
+
+/**
+ * @brief Stops the background thread, leaving anything still queued for next mount.
+ */
+void reclaim_stop();
+
+#endif
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "compress.h"
+#include "dedup.h"
+#include "pages.h"
+#include "readahead.h"
+#include "tier.h"
+
+#include "stats.h"
+
+// Latencies go in log2 buckets split four ways, so each bucket is within 25% of
+// the values in it, up to 2^STATS_MAX_BITS ns
+#define STATS_SUB_BITS 2
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS (STATS_MAX_BITS << STATS_SUB_BITS)
+#define STATS_PROMETHEUS_MIN_BITS 10 // Prometheus buckets start at 2^10 ns
+
+typedef struct op_counters {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+} op_counters;
+
+typedef struct thread_counters {
+  op_counters ops[STATS_OP_COUNT];
+  struct thread_counters* next;
+} thread_counters;
+
+static const char* OP_NAMES[STATS_OP_COUNT] = {
+  "access", "getattr", "statfs", "readdir", "mknod", "mkdir", "unlink", "link",
+  "symlink", "readlink", "rmdir", "rename", "chmod", "truncate", "open", "read",
+  "write", "read_buf", "write_buf", "release", "fsync", "utimens", "ioctl",
+  "tree_lookup", "directory_lookup", "alloc_page", "grow_inode", "read_copy",
+  "write_copy",
+};
+
+// Every thread that has recorded anything, newest first. Blocks are never freed,
+// so counts from threads that have exited still show up.
+static thread_counters* allThreads = 0;
+static __thread thread_counters* mine = 0;
+
+static thread_counters* get_mine() {
+  if (mine == 0) {
+    mine = calloc(1, sizeof(thread_counters));
+    mine->next = __atomic_load_n(&allThreads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&allThreads, &mine->next, mine, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+  return mine;
+}
+
+static int bucket_of(uint64_t ns) {
+  if (ns < (1 << STATS_SUB_BITS)) {
+    return ns;
+  }
+
+  int bits = 63 - __builtin_clzll(ns);
+  if (bits >= STATS_MAX_BITS) {
+    return STATS_BUCKETS - 1;
+  }
+  int sub = (ns >> (bits - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1);
+  return ((bits - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+// The largest latency that lands in a bucket
+static uint64_t bucket_limit(int bucket) {
+  if (bucket < (1 << STATS_SUB_BITS)) {
+    return bucket;
+  }
+
+  int bits = (bucket >> STATS_SUB_BITS) + 1;
+  uint64_t sub = bucket & ((1 << STATS_SUB_BITS) - 1);
+  return ((((uint64_t)1 << STATS_SUB_BITS) + sub + 1) << (bits - STATS_SUB_BITS)) - 1;
+}
+
+uint64_t stats_begin() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Only the owning thread writes, the stores are atomic so readers never see a torn value
+static void bump(uint64_t* counter, uint64_t by) {
+  __atomic_store_n(counter, *counter + by, __ATOMIC_RELAXED);
+}
+
+void stats_end(stats_op op, uint64_t start) {
+  uint64_t ns = stats_begin() - start;
+  op_counters* counters = &get_mine()->ops[op];
+
+  bump(&counters->count, 1);
+  bump(&counters->total_ns, ns);
+  bump(&counters->buckets[bucket_of(ns)], 1);
+  if (ns > counters->max_ns) {
+    __atomic_store_n(&counters->max_ns, ns, __ATOMIC_RELAXED);
+  }
+}
+
+static void sum_threads(op_counters* sums) {
+  for (thread_counters* tt = __atomic_load_n(&allThreads, __ATOMIC_ACQUIRE); tt != 0;
+       tt = tt->next) {
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+      op_counters* from = &tt->ops[op];
+      op_counters* to = &sums[op];
+      to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+      to->total_ns += __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+      uint64_t max = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+      to->max_ns = max > to->max_ns ? max : to->max_ns;
+      for (int bb = 0; bb < STATS_BUCKETS; bb++) {
+        to->buckets[bb] += __atomic_load_n(&from->buckets[bb], __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+// The bucket limit below which a fraction of the operations finished
+static uint64_t percentile(op_counters* counters, double fraction) {
+  uint64_t target = counters->count * fraction;
+  uint64_t seen = 0;
+  for (int bb = 0; bb < STATS_BUCKETS; bb++) {
+    seen += counters->buckets[bb];
+    if (seen > target) {
+      return bucket_limit(bb);
+    }
+  }
+  return counters->max_ns;
+}
+
+static void render_json(FILE* out, op_counters* sums) {
+  fprintf(out, "{\n  \"ops\": {");
+  int first = 1;
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    op_counters* counters = &sums[op];
+    if (counters->count == 0) {
+      continue;
+    }
+
+    fprintf(out, "%s\n    \"%s\": {\"count\": %lu, \"total_ns\": %lu, \"max_ns\": %lu, "
+                 "\"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu}",
+            first ? "" : ",", OP_NAMES[op], counters->count, counters->total_ns,
+            counters->max_ns, percentile(counters, 0.5), percentile(counters, 0.9),
+            percentile(counters, 0.99), percentile(counters, 0.999));
+    first = 0;
+  }
+  fprintf(out, "\n  },\n");
+
+  superblock* sb = get_superblock();
+  pages_stats faults = pages_get_stats();
+  readahead_stats ra = readahead_get_stats();
+  dedup_stats dedup = dedup_get_stats();
+  compress_stats compress = compress_get_stats();
+  tier_stats tier = tier_get_stats();
+
+  fprintf(out, "  \"free_pages\": %d,\n  \"free_inodes\": %d,\n", sb->free_pages,
+          sb->free_inodes);
+  fprintf(out, "  \"minor_faults\": %ld,\n  \"major_faults\": %ld,\n", faults.minor_faults,
+          faults.major_faults);
+  fprintf(out, "  \"readahead_streams\": %ld,\n  \"readahead_pages\": %ld,\n", ra.streams,
+          ra.pages_prefetched);
+  fprintf(out, "  \"dedup_pages_scanned\": %ld,\n  \"dedup_pages_merged\": %ld,\n",
+          dedup.pages_scanned, dedup.pages_merged);
+  fprintf(out, "  \"compress_bytes_in\": %ld,\n  \"compress_bytes_out\": %ld,\n",
+          compress.bytes_in, compress.bytes_out);
+  fprintf(out, "  \"compress_cache_hits\": %ld,\n  \"compress_cache_misses\": %ld,\n",
+          compress.cache_hits, compress.cache_misses);
+
+  // Only a tiered image counts hits, the rate is 0 for the rest
+  int64_t hits = tier.fast_hits + tier.slow_hits;
+  fprintf(out, "  \"tier_fast_hits\": %ld,\n  \"tier_slow_hits\": %ld,\n"
+               "  \"tier_fast_hit_rate\": %.4f,\n", tier.fast_hits, tier.slow_hits,
+          hits > 0 ? (double)tier.fast_hits / hits : 0.0);
+  fprintf(out, "  \"tier_pages_promoted\": %ld,\n  \"tier_pages_demoted\": %ld\n}\n",
+          tier.pages_promoted, tier.pages_demoted);
+}
+
+static void render_gauge(FILE* out, const char* name, const char* type, int64_t value) {
+  fprintf(out, "# TYPE nufs_%s %s\nnufs_%s %ld\n", name, type, name, value);
+}
+
+static void render_prometheus(FILE* out, op_counters* sums) {
+  // Buckets are merged to powers of two to keep the output short
+  fprintf(out, "# TYPE nufs_op_duration_seconds histogram\n");
+  for (int op = 0; op < STATS_OP_COUNT; op++) {
+    op_counters* counters = &sums[op];
+    if (counters->count == 0) {
+      continue;
+    }
+
+    uint64_t cumulative = 0;
+    int bb = 0;
+    for (int bits = STATS_PROMETHEUS_MIN_BITS; bits <= STATS_MAX_BITS; bits++) {
+      uint64_t le = (uint64_t)1 << bits;
+      while (bb < STATS_BUCKETS && bucket_limit(bb) < le) {
+        cumulative += counters->buckets[bb++];
+      }
+      fprintf(out, "nufs_op_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %lu\n",
+              OP_NAMES[op], le / 1e9, cumulative);
+    }
+    fprintf(out, "nufs_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", OP_NAMES[op],
+            counters->count);
+    fprintf(out, "nufs_op_duration_seconds_sum{op=\"%s\"} %g\n", OP_NAMES[op],
+            counters->total_ns / 1e9);
+    fprintf(out, "nufs_op_duration_seconds_count{op=\"%s\"} %lu\n", OP_NAMES[op],
+            counters->count);
+  }
+
+  superblock* sb = get_superblock();
+  pages_stats faults = pages_get_stats();
+  readahead_stats ra = readahead_get_stats();
+  dedup_stats dedup = dedup_get_stats();
+  compress_stats compress = compress_get_stats();
+  tier_stats tier = tier_get_stats();
+
+  render_gauge(out, "free_pages", "gauge", sb->free_pages);
+  render_gauge(out, "free_inodes", "gauge", sb->free_inodes);
+  render_gauge(out, "minor_faults_total", "counter", faults.minor_faults);
+  render_gauge(out, "major_faults_total", "counter", faults.major_faults);
+  render_gauge(out, "readahead_streams_total", "counter", ra.streams);
+  render_gauge(out, "readahead_pages_total", "counter", ra.pages_prefetched);
+  render_gauge(out, "dedup_pages_scanned_total", "counter", dedup.pages_scanned);
+  render_gauge(out, "dedup_pages_merged_total", "counter", dedup.pages_merged);
+  render_gauge(out, "compress_bytes_in_total", "counter", compress.bytes_in);
+  render_gauge(out, "compress_bytes_out_total", "counter", compress.bytes_out);
+  render_gauge(out, "compress_cache_hits_total", "counter", compress.cache_hits);
+  render_gauge(out, "compress_cache_misses_total", "counter", compress.cache_misses);
+  render_gauge(out, "tier_fast_hits_total", "counter", tier.fast_hits);
+  render_gauge(out, "tier_slow_hits_total", "counter", tier.slow_hits);
+  render_gauge(out, "tier_pages_promoted_total", "counter", tier.pages_promoted);
+  render_gauge(out, "tier_pages_demoted_total", "counter", tier.pages_demoted);
+}
+
+char* stats_render(int format, size_t* size) {
+  op_counters* sums = calloc(STATS_OP_COUNT, sizeof(op_counters));
+  sum_threads(sums);
+
+  char* text = 0;
+  FILE* out = open_memstream(&text, size);
+  if (format == STATS_PROMETHEUS) {
+    render_prometheus(out, sums);
+  } else {
+    render_json(out, sums);
+  }
+  fclose(out);
+
+  free(sums);
+  return text;
+}
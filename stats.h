@@ -0,0 +1,74 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_DIR "/.nufs" // virtual directory in the mount, not stored in the image
+#define STATS_JSON_FILE STATS_DIR "/stats"
+#define STATS_PROMETHEUS_FILE STATS_DIR "/metrics"
+
+#define STATS_JSON 0
+#define STATS_PROMETHEUS 1
+
+// Timed operations, FUSE callbacks first and then storage primitives
+typedef enum stats_op {
+  STATS_OP_ACCESS,
+  STATS_OP_GETATTR,
+  STATS_OP_STATFS,
+  STATS_OP_READDIR,
+  STATS_OP_MKNOD,
+  STATS_OP_MKDIR,
+  STATS_OP_UNLINK,
+  STATS_OP_LINK,
+  STATS_OP_SYMLINK,
+  STATS_OP_READLINK,
+  STATS_OP_RMDIR,
+  STATS_OP_RENAME,
+  STATS_OP_CHMOD,
+  STATS_OP_TRUNCATE,
+  STATS_OP_OPEN,
+  STATS_OP_READ,
+  STATS_OP_WRITE,
+  STATS_OP_READ_BUF,
+  STATS_OP_WRITE_BUF,
+  STATS_OP_RELEASE,
+  STATS_OP_FSYNC,
+  STATS_OP_UTIMENS,
+  STATS_OP_IOCTL,
+  STATS_TREE_LOOKUP,
+  STATS_DIRECTORY_LOOKUP,
+  STATS_ALLOC_PAGE,
+  STATS_GROW_INODE,
+  STATS_READ_COPY,
+  STATS_WRITE_COPY,
+  STATS_OP_COUNT
+} stats_op;
+
+/**
+ * @brief Starts timing an operation.
+ * 
+ * @return uint64_t the start time, to pass to stats_end
+ */
+uint64_t stats_begin();
+
+/**
+ * @brief Records an operation's latency in the calling thread's counters, which
+ *        no other thread writes to.
+ * 
+ * @param op the operation
+ * @param start the time from stats_begin
+ */
+void stats_end(stats_op op, uint64_t start);
+
+/**
+ * @brief Writes out every thread's counters added together, along with the
+ *        totals kept by the other modules.
+ * 
+ * @param format STATS_JSON or STATS_PROMETHEUS
+ * @param size set to the length of the text
+ * @return char* the text, to be freed by the caller
+ */
+char* stats_render(int format, size_t* size);
+
+#endif
@@ -1,450 +1,1245 @@
-#include <assert.h>
-#include <errno.h>
-
-#include "bitmap.h"
-#include "directory.h"
-#include "pages.h"
-#include "slist.h"
-#include "util.h"
-
-#include "storage.h"
-
-void storage_init(const char* path) {
-  pages_init(path);
-  inodes_init();
-  directory_init();
-}
-
-int storage_stat(const char* path, struct stat* st) {
-  int inodeIdx = tree_lookup(path);
-
-  if (inodeIdx != -ENOENT) {
-    inode* found = get_inode(inodeIdx);
-
-    st->st_mode = found->mode;
-    st->st_size = found->size;
-    st->st_uid = getuid();
-    st->st_atime = found->atime;
-    st->st_mtime = found->mtime;
-    st->st_ctime = found->ctime;
-    st->st_nlink = found->refs + 1;
-
-    return 0;
-  } else {
-    return -ENOENT;
-  }
-}
-
-int storage_mknod(const char* path, int mode) {
-    filepath node = to_filepath(path);
-    int dirIdx = tree_lookup(node.crumbs);
-
-    if (dirIdx < 0 || streq(node.file, "")) {
-      return -ENOENT;
-    }
-
-    int newNodeIdx = alloc_inode();
-    int newPageIdx = alloc_page();
-
-    if (newNodeIdx < 0 || newPageIdx < 0) {
-        if (newNodeIdx >= 0) {
-            free_inode(newNodeIdx);
-        }
-
-        if (newPageIdx >= 0) {
-            free_page(newPageIdx);
-        }
-
-        return -ENOSPC;
-    }
-
-    inode* newNode = get_inode(newNodeIdx);
-
-    newNode->ptrs[0] = newPageIdx;
-    newNode->mode = mode;
-    time_t currentTime = time(NULL);
-    newNode->atime = currentTime;
-    newNode->ctime = currentTime;
-    newNode->mtime = currentTime;
-
-    int rv = directory_put(get_inode(dirIdx), node.file, newNodeIdx);
-    assert(rv == 0);
-
-    if (is_folder(mode) || is_link(mode)) {
-      newNode->size = PAGE_SIZE;
-    }
-
-    return 0;
-}
-
-int storage_unlink(const char* path) {
-  filepath fp = to_filepath(path);
-
-  int dirIdx = tree_lookup(fp.crumbs);
-  inode* dir = get_inode(dirIdx);
-  dirent* fileEnt = directory_lookup(dir, fp.file);
-
-  if (dirIdx < 0 || fileEnt == 0) {
-    return -ENOENT;
-  }
-
-  inode* file = get_inode(fileEnt->inum);
-
-  if (file->refs == 0) {
-    if (is_folder(file->mode)) {
-      char nestedPath[4096];
-      strncpy(nestedPath, path, 4096);
-      join_to_path(nestedPath, fp.file);
-      int rv = storage_rmdir(nestedPath);
-      if (rv != 0) {
-        return rv;
-      }
-    }
-
-    free_inode(fileEnt->inum);
-  } else {
-    file->refs--;
-  }
-
-  directory_delete(dir, fp.file);
-
-  return 0;
-}
-
-int storage_link(const char* from, const char* to) {
-  filepath fp = to_filepath(to);
-  int fromIdx = tree_lookup(from);
-  int toIdx = tree_lookup(to);
-  int toParentIdx = tree_lookup(fp.crumbs);
-  if (fromIdx < 0 || toParentIdx < 0) {
-    return -ENOENT;
-  }
-  if (toIdx >= 0) {
-    return -EEXIST;
-  }
-
-  inode* fromFile = get_inode(fromIdx);
-
-  if (is_folder(fromFile->mode)) {
-    return -EISDIR;
-  }
-
-  inode* toParent = get_inode(toParentIdx);
-
-  int rv = directory_put(toParent, fp.file, fromIdx);
-
-  if (rv == 0) {
-    fromFile->refs++;
-    return 0;
-  } else {
-    return rv;
-  }
-}
-
-int storage_symlink(const char* to, const char* from) {
-  int fromIdx = tree_lookup(from);
-  if (fromIdx >= 0) {
-    return -EEXIST;
-  }
-
-  int rv = storage_mknod(from, __S_IFLNK | 0777);
-
-  if (rv < 0) {
-    return rv;
-  }
-
-  fromIdx = tree_lookup(from);
-
-  inode* link = get_inode(fromIdx);
-
-  strncpy(pages_get_page(link->ptrs[0]), to, PAGE_SIZE);
-  return 0;
-}
-
-int storage_readlink(const char* path, char* buf, size_t size) {
-  int linkIdx = tree_lookup(path);
-  if (linkIdx < 0) {
-    return -ENOENT;
-  }
-  inode* link = get_inode(linkIdx);
-
-  if (is_link(link->mode)) {
-    size = min(size, PAGE_SIZE);
-    strncpy(buf, pages_get_page(link->ptrs[0]), size);
-    return 0;
-  } else {
-    return -EPERM;
-  }
-}
-
-int storage_rename(const char *from, const char *to) {
-  filepath fpOld = to_filepath(from);
-  filepath fpNew = to_filepath(to);
-
-  if (!streq(fpOld.crumbs, fpNew.crumbs)) {
-    return -1;
-  } else {
-    int dirIdx = tree_lookup(fpOld.crumbs);
-
-    dirent* entry = directory_lookup(get_inode(dirIdx), fpOld.file);
-
-    if (entry > 0) {
-      strncpy(entry->name, fpNew.file, 48);
-      return 0;
-  } else {
-      return -ENOENT;
-    }
-  }
-}
-
-int storage_read(const char* path, char* buf, size_t size, off_t offset) {
-  int fileIdx = tree_lookup(path);
-
-  if (fileIdx < 0) {
-    return -ENOENT;
-  }
-
-  inode* file = get_inode(fileIdx);
-
-  if (is_folder(file->mode)) {
-    return -EISDIR;
-  }
-
-  if ((file->mode & __S_IFREG) == __S_IFREG) {
-    if (offset >= file->size) {
-      return 0;
-    }
-
-    // Set maximum readable bytes, either the size or to the EOF, whichever is smaller
-    size = size < file->size - offset ? size : file->size - offset;
-
-    // Adjust for offsets across inodes
-    while (offset >= 5 * PAGE_SIZE) {
-      file = get_inode(file->iptr);
-      offset -= 5 * PAGE_SIZE;
-    }
-
-    size_t bytesLeft = size;
-    size_t bufOffset = 0;
-    while (bytesLeft > 0) {
-      // Read from direct pointers
-      for (int ii = 0; ii < 5; ii++) {
-        void* currentPage = pages_get_page(file->ptrs[ii]);
-        if (offset >= PAGE_SIZE) {
-          offset -= PAGE_SIZE;
-        } else {
-          int maxBytes = PAGE_SIZE - offset;
-          int bytesRead = min(bytesLeft, maxBytes);
-          memcpy(buf + bufOffset, currentPage + offset, bytesRead);
-          offset = 0;
-          bufOffset += bytesRead;
-          bytesLeft -= bytesRead;
-        }
-      }
-
-      // Continue reading from indirect nodes
-      file = get_inode(file->iptr);
-    }
-
-    file->atime = time(NULL);
-
-    return size;
-  }
-
-  return -1;
-}
-
-int storage_write(const char* path, const char* buf, size_t size, off_t offset) {
-  int fileIdx = tree_lookup(path);
-
-  if (fileIdx < 0) {
-    return -ENOENT;
-  }
-
-  inode* file = get_inode(fileIdx);
-
-  if (is_folder(file->mode)) {
-    return -EISDIR;
-  }
-
-  if ((file->mode & __S_IFREG) == __S_IFREG) {
-    // Grow inode if it is too small to store data to write
-    if (offset + size > file->size) {
-      grow_inode(file, offset + size);
-    }
-
-    // Adjust for offsets across inodes
-    while (offset >= 5 * PAGE_SIZE) {
-      file = get_inode(file->iptr);
-      offset -= 5 * PAGE_SIZE;
-    }
-
-    size_t bytesLeft = size;
-    int bufOffset = 0;
-    while (bytesLeft > 0) {
-      // Write to direct pointers
-      for (int ii = 0; ii < 5; ii++) {
-        void* currentPage = pages_get_page(file->ptrs[ii]);
-        if (offset >= PAGE_SIZE) {
-          offset -= PAGE_SIZE;
-        } else {
-          int maxBytes = PAGE_SIZE - offset;
-          int bytesRead = min(bytesLeft, maxBytes);
-          memcpy(currentPage + offset, buf + bufOffset, bytesRead);
-          offset = 0;
-          bufOffset += bytesRead;
-          bytesLeft -= bytesRead;
-        }
-      }
-
-      // Continue writing to indirect nodes
-      file = get_inode(file->iptr);
-    }
-
-    file->mtime = time(NULL);
-
-    return size;
-  }
-
-  return -1;
-}
-
-int storage_truncate(const char *path, off_t size) {
-  int fileIdx = tree_lookup(path);
-  if (fileIdx < 0) {
-    return -ENOENT;
-  }
-  
-  inode* file = get_inode(fileIdx);
-
-  file->mtime = time(NULL);
-
-  if (size > file->size) {
-    return grow_inode(file, size);
-  } else {
-    return shrink_inode(file, size);
-  }
-}
-
-int storage_access(const char* path, int mask) {
-  // TODO: Add support for other masks
-  int rv = 0;
-
-  if (mask = F_OK) {
-    // If the file doesn't exist, return ENOENT
-    rv = tree_lookup(path) < 0 ? -ENOENT : 0;
-  }
-
-  return rv;
-}
-
-int storage_set_time(const char* path, const struct timespec ts[2]) {
-  int rv = 0;
-  int fileIdx = tree_lookup(path);
-
-  if (fileIdx < 0) {
-    return -ENOENT;
-  }
-
-  inode* file = get_inode(fileIdx);
-  file->atime = ts[0].tv_sec;
-  file->mtime = ts[1].tv_sec;
-  return rv;  
-}
-
-slist* storage_list(const char* path) {
-  return directory_list(path);
-}
-
-int storage_mkdir(const char* path, mode_t mode) {
-  int rv = storage_mknod(path, __S_IFDIR | mode);
-  if (rv != 0) {
-    return -ENOSPC;
-  }
-
-  filepath fp = to_filepath(path);
-
-  int dirIdx = tree_lookup(path);
-  int parentIdx = tree_lookup(fp.crumbs);
-
-  inode* dir = get_inode(dirIdx);
-
-  directory_put(dir, ".", dirIdx);
-  directory_put(dir, "..", parentIdx);
-
-  return rv;
-}
-
-int storage_rmdir(const char* path) {
-  int dirIdx = tree_lookup(path);
-  if (dirIdx < 0) {
-    return -ENOENT;
-  }
-
-  filepath fp = to_filepath(path);
-  int parentIdx = tree_lookup(fp.crumbs);
-
-  inode* dir = get_inode(dirIdx);
-  inode* parent = get_inode(parentIdx);
-
-  if (is_folder(dir->mode)) {
-    int rv;
-    slist* contents = directory_list(path);
-
-    while (contents != 0) {
-      if (!streq(contents->data, ".") && !streq(contents->data, "..")) {
-        char filePath[4096];
-        strncpy(filePath, path, 4096);
-        join_to_path(filePath, contents->data);
-        rv = storage_unlink(filePath);
-        if (rv != 0) {
-          return rv;
-        }
-      }
-
-      contents = contents->next;
-    }
-
-    free_inode(dirIdx);
-    return directory_delete(parent, fp.file);
-  } else {
-    return -ENOTDIR;
-  }
-}
-
-int storage_chmod(const char* path, mode_t mode) {
-  int fileIdx = tree_lookup(path);
-
-  if (fileIdx < 0) {
-    return -ENOENT;
-  }
-
-  inode* file = get_inode(fileIdx);
-  file->mode = mode;
-  file->ctime = time(NULL); 
-
-  return 0;
-}
-
-filepath to_filepath(const char* path) {
-    filepath ret;
-    strcpy(ret.crumbs, "/");
-
-    assert(*path == '/');
-
-    slist* tokens = s_split(path, '/');
-
-    while (tokens != 0) {
-        if (tokens->next == 0) {
-            strncpy(ret.file, tokens->data, 255);
-        } else {
-            join_to_path(ret.crumbs, tokens->data);
-        }
-
-        tokens = tokens->next;
-    }
-
-    s_free(tokens);
-
-    return ret;
-}
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bitmap.h"
+#include "compress.h"
+#include "dedup.h"
+#include "directory.h"
+#include "options.h"
+#include "pages.h"
+#include "rebuild.h"
+#include "reclaim.h"
+#include "slist.h"
+#include "stats.h"
+#include "tier.h"
+#include "timestamps.h"
+#include "util.h"
+
+#include "storage.h"
+
+// Snapshot inodes reject every modification except removal of the whole snapshot
+static int is_readonly(int inum) {
+  inode* node = get_inode(inum);
+  return node != 0 && (node->flags & INODE_READONLY);
+}
+
+// Drops one link to an inode, queueing it to be freed when it was the last
+static void drop_link(int inum) {
+  inode* node = get_inode(inum);
+
+  if (node->refs > 0) {
+    node->refs--;
+  } else {
+    reclaim_detach(inum);
+  }
+}
+
+// Serializes FUSE callbacks with background threads such as the reclaimer
+static pthread_mutex_t storageMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void storage_lock() {
+  pthread_mutex_lock(&storageMutex);
+}
+
+void storage_unlock() {
+  pthread_mutex_unlock(&storageMutex);
+}
+
+void storage_init(const char* path) {
+  int dirty = pages_init(path);
+  if (dirty) {
+    rebuild_begin();
+  }
+  directory_init();
+}
+
+void storage_start() {
+  reclaim_start();
+  rebuild_start();
+  timestamps_start();
+  tier_start();
+}
+
+void storage_stop() {
+  reclaim_stop();
+  rebuild_stop();
+  timestamps_stop();
+  tier_stop();
+
+  // Everything has to be trusted again before the image can be called clean
+  storage_lock();
+  timestamps_flush(-1);
+  rebuild_run(-1);
+  pages_unpin_all();
+  pages_mark_clean();
+  storage_unlock();
+}
+
+static void fill_stat(int inum, struct stat* st) {
+  inode* found = get_inode(inum);
+
+  st->st_mode = found->mode;
+  st->st_size = found->size;
+  st->st_uid = getuid();
+  timestamps_fill(inum, st);
+  st->st_nlink = found->refs + 1;
+}
+
+int storage_stat(const char* path, struct stat* st) {
+  int inodeIdx = tree_lookup(path);
+
+  if (inodeIdx != -ENOENT) {
+    fill_stat(inodeIdx, st);
+    return 0;
+  } else {
+    return -ENOENT;
+  }
+}
+
+int storage_statfs(struct statvfs* st) {
+  superblock* sb = get_superblock();
+
+  memset(st, 0, sizeof(*st));
+  st->f_bsize = PAGE_SIZE;
+  st->f_frsize = PAGE_SIZE;
+  st->f_blocks = PAGE_COUNT;
+  st->f_bfree = sb->free_pages;
+  st->f_bavail = sb->free_pages;
+  st->f_files = INODE_COUNT;
+  st->f_ffree = sb->free_inodes;
+  st->f_favail = sb->free_inodes;
+  st->f_namemax = directory_name_max();
+
+  return 0;
+}
+
+int storage_mknod(const char* path, int mode) {
+    filepath node = to_filepath(path);
+    int dirIdx = tree_lookup(node.crumbs);
+
+    if (dirIdx < 0 || streq(node.file, "")) {
+      return -ENOENT;
+    }
+
+    if (strlen(node.file) > directory_name_max()) {
+      return -ENAMETOOLONG;
+    }
+
+    if (is_readonly(dirIdx)) {
+      return -EROFS;
+    }
+
+    int newNodeIdx = alloc_inode();
+    int newPageIdx = alloc_page();
+
+    if (newNodeIdx < 0 || newPageIdx < 0) {
+        if (newNodeIdx >= 0) {
+            free_inode(newNodeIdx);
+        }
+
+        if (newPageIdx >= 0) {
+            free_page(newPageIdx);
+        }
+
+        return -ENOSPC;
+    }
+
+    inode* newNode = get_inode(newNodeIdx);
+
+    newNode->ptrs[0] = newPageIdx;
+    newNode->mode = mode;
+    time_t currentTime = timestamps_now();
+    newNode->atime = currentTime;
+    newNode->ctime = currentTime;
+    newNode->mtime = currentTime;
+
+    int rv = directory_put(get_inode(dirIdx), node.file, newNodeIdx);
+    if (rv != 0) {
+        free_inode(newNodeIdx);
+        return rv;
+    }
+
+    if (is_folder(mode) || is_link(mode)) {
+      newNode->size = PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+int storage_unlink(const char* path) {
+  filepath fp = to_filepath(path);
+
+  int dirIdx = tree_lookup(fp.crumbs);
+  inode* dir = get_inode(dirIdx);
+  int* fileEnt = directory_lookup(dir, fp.file);
+
+  if (dirIdx < 0 || fileEnt == 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(dirIdx)) {
+    return -EROFS;
+  }
+
+  // Unlink first so the name is gone before anything is freed
+  int fileIdx = *fileEnt;
+  directory_delete(dir, fp.file);
+  drop_link(fileIdx);
+
+  return 0;
+}
+
+int storage_link(const char* from, const char* to) {
+  filepath fp = to_filepath(to);
+  int fromIdx = tree_lookup(from);
+  int toIdx = tree_lookup(to);
+  int toParentIdx = tree_lookup(fp.crumbs);
+  if (fromIdx < 0 || toParentIdx < 0) {
+    return -ENOENT;
+  }
+  if (toIdx >= 0) {
+    return -EEXIST;
+  }
+
+  if (is_readonly(toParentIdx)) {
+    return -EROFS;
+  }
+
+  inode* fromFile = get_inode(fromIdx);
+
+  if (is_folder(fromFile->mode)) {
+    return -EISDIR;
+  }
+
+  inode* toParent = get_inode(toParentIdx);
+
+  int rv = directory_put(toParent, fp.file, fromIdx);
+
+  if (rv == 0) {
+    fromFile->refs++;
+    return 0;
+  } else {
+    return rv;
+  }
+}
+
+int storage_symlink(const char* to, const char* from) {
+  int fromIdx = tree_lookup(from);
+  if (fromIdx >= 0) {
+    return -EEXIST;
+  }
+
+  int rv = storage_mknod(from, __S_IFLNK | 0777);
+
+  if (rv < 0) {
+    return rv;
+  }
+
+  fromIdx = tree_lookup(from);
+
+  inode* link = get_inode(fromIdx);
+
+  strncpy(pages_get_page(link->ptrs[0]), to, PAGE_SIZE);
+  return 0;
+}
+
+int storage_readlink(const char* path, char* buf, size_t size) {
+  int linkIdx = tree_lookup(path);
+  if (linkIdx < 0) {
+    return -ENOENT;
+  }
+  inode* link = get_inode(linkIdx);
+
+  if (is_link(link->mode)) {
+    size = min(size, PAGE_SIZE);
+    strncpy(buf, pages_get_page(link->ptrs[0]), size);
+    return 0;
+  } else {
+    return -EPERM;
+  }
+}
+
+static int has_children_entry(const char* name, int inum, void* arg) {
+  return !streq(name, ".") && !streq(name, "..");
+}
+
+// Points a directory's .. entry at a new parent after it moves
+static void reparent(int dirIdx, int parentIdx) {
+  inode* dir = get_inode(dirIdx);
+  if (is_folder(dir->mode)) {
+    int* dotdot = directory_lookup(dir, "..");
+    if (dotdot != 0) {
+      directory_set_inum(dotdot, parentIdx);
+    }
+  }
+}
+
+// Whether the directory at inum is dirIdx or somewhere below it
+static int is_within(int inum, int dirIdx) {
+  for (int depth = 0; depth < INODE_COUNT; depth++) {
+    if (inum == dirIdx) {
+      return 1;
+    }
+    if (inum == 0) {
+      return 0;
+    }
+
+    int* dotdot = directory_lookup(get_inode(inum), "..");
+    if (dotdot == 0) {
+      return 0;
+    }
+    inum = *dotdot;
+  }
+
+  return 0;
+}
+
+int storage_rename(const char *from, const char *to, unsigned int flags) {
+  filepath fpOld = to_filepath(from);
+  filepath fpNew = to_filepath(to);
+
+  if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)) {
+    return -EINVAL;
+  }
+
+  int oldDirIdx = tree_lookup(fpOld.crumbs);
+  int newDirIdx = tree_lookup(fpNew.crumbs);
+
+  if (oldDirIdx < 0 || newDirIdx < 0 || streq(fpNew.file, "")) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(oldDirIdx) || is_readonly(newDirIdx)) {
+    return -EROFS;
+  }
+
+  inode* oldDir = get_inode(oldDirIdx);
+  inode* newDir = get_inode(newDirIdx);
+  int* src = directory_lookup(oldDir, fpOld.file);
+  int* dst = directory_lookup(newDir, fpNew.file);
+
+  if (src == 0) {
+    return -ENOENT;
+  }
+
+  // Renaming onto another link to the same inode does nothing
+  if (src == dst || (dst != 0 && *dst == *src)) {
+    return 0;
+  }
+
+  int srcIdx = *src;
+  inode* srcNode = get_inode(srcIdx);
+
+  // A directory can't be moved below itself
+  if (is_folder(srcNode->mode) && is_within(newDirIdx, srcIdx)) {
+    return -EINVAL;
+  }
+
+  if (flags & RENAME_EXCHANGE) {
+    if (dst == 0) {
+      return -ENOENT;
+    }
+
+    int dstIdx = *dst;
+    if (is_folder(get_inode(dstIdx)->mode) && is_within(oldDirIdx, dstIdx)) {
+      return -EINVAL;
+    }
+
+    directory_set_inum(src, dstIdx);
+    directory_set_inum(dst, srcIdx);
+
+    if (oldDirIdx != newDirIdx) {
+      reparent(srcIdx, newDirIdx);
+      reparent(dstIdx, oldDirIdx);
+    }
+
+    return 0;
+  }
+
+  if (dst != 0) {
+    if (flags & RENAME_NOREPLACE) {
+      return -EEXIST;
+    }
+
+    int dstIdx = *dst;
+    inode* dstNode = get_inode(dstIdx);
+
+    if (is_folder(srcNode->mode) && !is_folder(dstNode->mode)) {
+      return -ENOTDIR;
+    }
+    if (!is_folder(srcNode->mode) && is_folder(dstNode->mode)) {
+      return -EISDIR;
+    }
+    if (is_folder(dstNode->mode) && directory_foreach(dstNode, has_children_entry, 0)) {
+      return -ENOTEMPTY;
+    }
+
+    // Swinging the existing entry over replaces the target in a single store,
+    // so the name never goes missing
+    directory_set_inum(dst, srcIdx);
+    directory_delete(oldDir, fpOld.file);
+    drop_link(dstIdx);
+  } else {
+    // Link under the new name before unlinking the old one
+    int rv = directory_put(newDir, fpNew.file, srcIdx);
+    if (rv != 0) {
+      return rv;
+    }
+    directory_delete(oldDir, fpOld.file);
+  }
+
+  if (oldDirIdx != newDirIdx) {
+    reparent(srcIdx, newDirIdx);
+  }
+
+  timestamps_touch(srcIdx, TIME_CTIME);
+
+  return 0;
+}
+
+int storage_read(const char* path, char* buf, size_t size, off_t offset) {
+  int fileIdx = tree_lookup(path);
+
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  inode* file = get_inode(fileIdx);
+
+  if (is_folder(file->mode)) {
+    return -EISDIR;
+  }
+
+  if ((file->mode & __S_IFREG) == __S_IFREG) {
+    if (offset >= file->size) {
+      return 0;
+    }
+
+    // Set maximum readable bytes, either the size or to the EOF, whichever is smaller
+    size = size < file->size - offset ? size : file->size - offset;
+
+    if (file->flags & INODE_COMPRESSED) {
+      timestamps_touch(fileIdx, TIME_ATIME);
+      return compress_read(fileIdx, buf, size, offset);
+    }
+
+    // Adjust for offsets across inodes
+    while (offset >= 5 * PAGE_SIZE) {
+      file = get_inode(file->iptr);
+      offset -= 5 * PAGE_SIZE;
+    }
+
+    uint64_t start = stats_begin();
+    size_t bytesLeft = size;
+    size_t bufOffset = 0;
+    while (bytesLeft > 0) {
+      // Read from direct pointers
+      for (int ii = 0; ii < 5; ii++) {
+        void* currentPage = pages_get_page(file->ptrs[ii]);
+        if (offset >= PAGE_SIZE) {
+          offset -= PAGE_SIZE;
+        } else {
+          int maxBytes = PAGE_SIZE - offset;
+          int bytesRead = min(bytesLeft, maxBytes);
+          if (bytesRead > 0) {
+            tier_touch(file->ptrs[ii]);
+          }
+          memcpy(buf + bufOffset, currentPage + offset, bytesRead);
+          offset = 0;
+          bufOffset += bytesRead;
+          bytesLeft -= bytesRead;
+        }
+      }
+
+      // Continue reading from indirect nodes
+      file = get_inode(file->iptr);
+    }
+    stats_end(STATS_READ_COPY, start);
+
+    timestamps_touch(fileIdx, TIME_ATIME);
+
+    return size;
+  }
+
+  return -1;
+}
+
+int storage_write(const char* path, const char* buf, size_t size, off_t offset) {
+  int fileIdx = tree_lookup(path);
+
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(fileIdx)) {
+    return -EROFS;
+  }
+
+  inode* file = get_inode(fileIdx);
+
+  if (is_folder(file->mode)) {
+    return -EISDIR;
+  }
+
+  if ((file->mode & __S_IFREG) == __S_IFREG) {
+    int rv = compress_inflate(fileIdx);
+    if (rv < 0) {
+      return rv;
+    }
+
+    // Grow inode if it is too small to store data to write
+    if (offset + size > file->size) {
+      rv = grow_inode(file, offset + size);
+      if (rv < 0) {
+        return -ENOSPC;
+      }
+    }
+
+    // Adjust for offsets across inodes
+    while (offset >= 5 * PAGE_SIZE) {
+      file = get_inode(file->iptr);
+      offset -= 5 * PAGE_SIZE;
+    }
+
+    uint64_t start = stats_begin();
+    size_t bytesLeft = size;
+    int bufOffset = 0;
+    while (bytesLeft > 0) {
+      // Write to direct pointers
+      for (int ii = 0; ii < 5; ii++) {
+        if (offset >= PAGE_SIZE) {
+          offset -= PAGE_SIZE;
+        } else {
+          int maxBytes = PAGE_SIZE - offset;
+          int bytesRead = min(bytesLeft, maxBytes);
+          if (bytesRead > 0) {
+            // Copy pages shared with snapshots before modifying them
+            int pageIdx = page_unshare(file->ptrs[ii]);
+            if (pageIdx < 0) {
+              stats_end(STATS_WRITE_COPY, start);
+              return -ENOSPC;
+            }
+            file->ptrs[ii] = pageIdx;
+            tier_touch(pageIdx);
+          }
+          void* currentPage = pages_get_page(file->ptrs[ii]);
+          memcpy(currentPage + offset, buf + bufOffset, bytesRead);
+          offset = 0;
+          bufOffset += bytesRead;
+          bytesLeft -= bytesRead;
+        }
+      }
+
+      // Continue writing to indirect nodes
+      file = get_inode(file->iptr);
+    }
+    stats_end(STATS_WRITE_COPY, start);
+
+    timestamps_touch(fileIdx, TIME_MTIME | TIME_CTIME);
+
+    return size;
+  }
+
+  return -1;
+}
+
+// Collects the image ranges behind part of a file, merging adjacent pages
+static void add_pin(storage_pins* pins, int pnum) {
+  if (pins->count == pins->cap) {
+    pins->cap = pins->cap > 0 ? 2 * pins->cap : 16;
+    pins->pnums = realloc(pins->pnums, pins->cap * sizeof(int));
+  }
+  pages_pin(pnum);
+  pins->pnums[pins->count++] = pnum;
+}
+
+void storage_unpin(storage_pins* pins) {
+  for (int ii = 0; ii < pins->count; ii++) {
+    pages_unpin(pins->pnums[ii]);
+  }
+  pins->count = 0;
+}
+
+static int collect_extents(inode* file, size_t size, off_t offset, int unshare,
+                           storage_extent* extents, storage_pins* pins) {
+  int count = 0;
+  size_t done = 0;
+
+  while (done < size) {
+    int* slot = inode_page_slot(file, (offset + done) / PAGE_SIZE);
+    if (slot == 0) {
+      break;
+    }
+
+    if (unshare) {
+      int pageIdx = page_unshare(*slot);
+      if (pageIdx < 0) {
+        return -ENOSPC;
+      }
+      *slot = pageIdx;
+    }
+
+    int inPage = (offset + done) % PAGE_SIZE;
+    size_t chunk = min(PAGE_SIZE - inPage, size - done);
+    tier_touch(*slot);
+    if (pins != 0) {
+      add_pin(pins, *slot);
+    }
+
+    off_t pos;
+    int fd = pages_locate(*slot, &pos);
+    pos += inPage;
+
+    if (count > 0 && extents[count - 1].fd == fd &&
+        extents[count - 1].pos + extents[count - 1].size == pos) {
+      extents[count - 1].size += chunk;
+    } else {
+      extents[count].fd = fd;
+      extents[count].pos = pos;
+      extents[count].size = chunk;
+      count++;
+    }
+    done += chunk;
+  }
+
+  return count;
+}
+
+int storage_read_extents(const char* path, size_t size, off_t offset,
+                         storage_extent* extents, storage_pins* pins) {
+  int fileIdx = tree_lookup(path);
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  inode* file = get_inode(fileIdx);
+  if (is_folder(file->mode)) {
+    return -EISDIR;
+  }
+
+  if (file->flags & INODE_COMPRESSED) {
+    return -ENOTSUP;
+  }
+
+  if (offset >= file->size) {
+    return 0;
+  }
+
+  timestamps_touch(fileIdx, TIME_ATIME);
+  size = min(size, file->size - offset);
+  return collect_extents(file, size, offset, 0, extents, pins);
+}
+
+int storage_write_extents(const char* path, size_t size, off_t offset,
+                          storage_extent* extents) {
+  int fileIdx = tree_lookup(path);
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(fileIdx)) {
+    return -EROFS;
+  }
+
+  inode* file = get_inode(fileIdx);
+  if (is_folder(file->mode)) {
+    return -EISDIR;
+  }
+
+  int rv = compress_inflate(fileIdx);
+  if (rv < 0) {
+    return rv;
+  }
+
+  if (offset + size > file->size) {
+    rv = grow_inode(file, offset + size);
+    if (rv < 0) {
+      return -ENOSPC;
+    }
+  }
+
+  timestamps_touch(fileIdx, TIME_MTIME | TIME_CTIME);
+  return collect_extents(file, size, offset, 1, extents, 0);
+}
+
+// Looks up a regular file that may be written to, returning its inode index
+static int lookup_writable_file(const char* path) {
+  int fileIdx = tree_lookup(path);
+
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(fileIdx)) {
+    return -EROFS;
+  }
+
+  inode* file = get_inode(fileIdx);
+
+  if (is_folder(file->mode)) {
+    return -EISDIR;
+  }
+
+  if ((file->mode & __S_IFREG) != __S_IFREG) {
+    return -EINVAL;
+  }
+
+  return fileIdx;
+}
+
+int storage_copy_range(const char* from, off_t fromOffset, const char* to,
+                       off_t toOffset, size_t size) {
+  int fromIdx = tree_lookup(from);
+  int toIdx = lookup_writable_file(to);
+
+  if (fromIdx < 0) {
+    return -ENOENT;
+  }
+  if (toIdx < 0) {
+    return toIdx;
+  }
+
+  inode* src = get_inode(fromIdx);
+  inode* dst = get_inode(toIdx);
+
+  if (is_folder(src->mode)) {
+    return -EISDIR;
+  }
+
+  if (fromOffset < 0 || toOffset < 0) {
+    return -EINVAL;
+  }
+  if (fromOffset >= src->size) {
+    return 0;
+  }
+
+  // Clamped without util.h's min, which would turn a large size_t negative.
+  // File sizes are ints, so the destination can't reach past INT_MAX.
+  if (size > (size_t)(src->size - fromOffset)) {
+    size = src->size - fromOffset;
+  }
+  if (toOffset > INT_MAX - (off_t)size) {
+    return -EFBIG;
+  }
+
+  // Overlapping ranges within one file are undefined, as for copy_file_range(2)
+  if (fromIdx == toIdx && fromOffset < toOffset + size && toOffset < fromOffset + size) {
+    return -EINVAL;
+  }
+
+  int rv = compress_inflate(toIdx);
+  if (rv < 0) {
+    return rv;
+  }
+
+  if (toOffset + size > dst->size) {
+    rv = grow_inode(dst, toOffset + size);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  size_t done = 0;
+
+  // Share whole pages when both sides line up. The last partial page can only be
+  // shared if it ends both files, since the rest of the page comes along with it.
+  // Compressed pages don't line up with file offsets at all.
+  if (fromOffset % PAGE_SIZE == 0 && toOffset % PAGE_SIZE == 0 &&
+      !(src->flags & INODE_COMPRESSED)) {
+    while (size - done >= PAGE_SIZE ||
+           (done < size && toOffset + size == dst->size && fromOffset + size == src->size)) {
+      int* fromSlot = inode_page_slot(src, (fromOffset + done) / PAGE_SIZE);
+      int* toSlot = inode_page_slot(dst, (toOffset + done) / PAGE_SIZE);
+
+      // Both files were sized to cover the range, a missing page means damage
+      if (fromSlot == 0 || toSlot == 0 || *fromSlot == 0 || *toSlot == 0) {
+        return -EIO;
+      }
+
+      // A page shared too often is left to the bounce buffer from here on
+      if (*toSlot != *fromSlot) {
+        if (page_share(*fromSlot) != 0) {
+          break;
+        }
+        free_page(*toSlot);
+        *toSlot = *fromSlot;
+      }
+
+      done += min(PAGE_SIZE, size - done);
+    }
+  }
+
+  // Copy whatever is left through a bounce buffer, kept off the stack since
+  // pages can be up to NUFS_MAX_PAGE_SIZE
+  char* buf = malloc(PAGE_SIZE);
+  if (buf == 0) {
+    return -ENOMEM;
+  }
+
+  while (done < size) {
+    int chunk = min(PAGE_SIZE, size - done);
+    int rv = storage_read(from, buf, chunk, fromOffset + done);
+    if (rv > 0) {
+      rv = storage_write(to, buf, rv, toOffset + done);
+    }
+    if (rv <= 0) {
+      free(buf);
+      return rv < 0 ? rv : -EIO;
+    }
+    done += rv;
+  }
+  free(buf);
+
+  timestamps_touch(toIdx, TIME_MTIME | TIME_CTIME);
+
+  return size;
+}
+
+int storage_clone(const char* from, const char* to) {
+  int fromIdx = tree_lookup(from);
+  int toIdx = lookup_writable_file(to);
+
+  if (fromIdx < 0) {
+    return -ENOENT;
+  }
+  if (toIdx < 0) {
+    return toIdx;
+  }
+  if (fromIdx == toIdx) {
+    return 0;
+  }
+
+  inode* src = get_inode(fromIdx);
+  inode* dst = get_inode(toIdx);
+
+  if ((src->mode & __S_IFREG) != __S_IFREG || is_folder(src->mode)) {
+    return -EINVAL;
+  }
+
+  // Drop the destination's own pages, then point it at the source's. If that
+  // runs out of inodes the destination is left empty.
+  shrink_inode(dst, 0);
+  dst->flags &= ~INODE_COMPRESSED;
+  compress_forget(toIdx);
+  int rv = share_inode(dst, src);
+  timestamps_touch(toIdx, TIME_MTIME | TIME_CTIME);
+
+  return rv;
+}
+
+int storage_flush(const char* path) {
+  int fileIdx = tree_lookup(path);
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(fileIdx)) {
+    return 0;
+  }
+
+  int rv = 0;
+  if (options.compress) {
+    rv = compress_file(fileIdx);
+  }
+
+  if (options.dedup) {
+    dedup_file(get_inode(fileIdx));
+  }
+
+  return rv;
+}
+
+int storage_fsync(const char* path) {
+  int fileIdx = tree_lookup(path);
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  timestamps_flush(fileIdx);
+  pages_sync();
+  return 0;
+}
+
+int storage_advise(const char* path, int advice) {
+  int fileIdx = tree_lookup(path);
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  inode* node = get_inode(fileIdx);
+  inode_advise(node, 0, bytes_to_pages(node->size), advice);
+  return 0;
+}
+
+int storage_readahead(const char* path, readahead_state* ra, off_t offset, size_t size) {
+  int fileIdx = tree_lookup(path);
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  readahead_access(ra, fileIdx, offset, size);
+  return 0;
+}
+
+int storage_truncate(const char *path, off_t size) {
+  int fileIdx = tree_lookup(path);
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(fileIdx)) {
+    return -EROFS;
+  }
+  
+  int rv = compress_inflate(fileIdx);
+  if (rv < 0) {
+    return rv;
+  }
+  
+  inode* file = get_inode(fileIdx);
+
+  timestamps_touch(fileIdx, TIME_MTIME | TIME_CTIME);
+
+  if (size > file->size) {
+    return grow_inode(file, size);
+  } else {
+    return shrink_inode(file, size);
+  }
+}
+
+int storage_access(const char* path, int mask) {
+  // TODO: Add support for other masks
+  int rv = 0;
+
+  if (mask = F_OK) {
+    // If the file doesn't exist, return ENOENT
+    rv = tree_lookup(path) < 0 ? -ENOENT : 0;
+  }
+
+  return rv;
+}
+
+int storage_set_time(const char* path, const struct timespec ts[2]) {
+  int rv = 0;
+  int fileIdx = tree_lookup(path);
+
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(fileIdx)) {
+    return -EROFS;
+  }
+
+  // Explicit times replace anything still pending
+  timestamps_flush(fileIdx);
+
+  inode* file = get_inode(fileIdx);
+  file->atime = ts[0].tv_sec;
+  file->mtime = ts[1].tv_sec;
+  return rv;  
+}
+
+slist* storage_list(const char* path) {
+  return directory_list(path);
+}
+
+typedef struct readdir_ctx {
+  int* inums;
+  int count;
+  int cap;
+  int (*fn)(const char* name, const struct stat* st, void* arg);
+  void* arg;
+} readdir_ctx;
+
+static int collect_inum(const char* name, int inum, void* arg) {
+  readdir_ctx* ctx = arg;
+  // Hard links can give a directory more entries than there are inodes
+  if (ctx->count == ctx->cap) {
+    ctx->cap = ctx->cap > 0 ? 2 * ctx->cap : 64;
+    ctx->inums = realloc(ctx->inums, ctx->cap * sizeof(int));
+  }
+  ctx->inums[ctx->count++] = inum;
+  return 0;
+}
+
+static int readdir_entry(const char* name, int inum, void* arg) {
+  readdir_ctx* ctx = arg;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  fill_stat(inum, &st);
+  return ctx->fn(name, &st, ctx->arg);
+}
+
+int storage_readdir(const char* path,
+                    int (*fn)(const char* name, const struct stat* st, void* arg), void* arg) {
+  int dirIdx = tree_lookup(path);
+  if (dirIdx < 0) {
+    return -ENOENT;
+  }
+
+  inode* dir = get_inode(dirIdx);
+  if (!is_folder(dir->mode)) {
+    return -ENOTDIR;
+  }
+
+  // Bring in the inode table pages of every child before filling in their stats
+  readdir_ctx ctx = { 0, 0, 0, fn, arg };
+  directory_foreach(dir, collect_inum, &ctx);
+  inodes_prefetch(ctx.inums, ctx.count);
+  free(ctx.inums);
+
+  directory_foreach(dir, readdir_entry, &ctx);
+  return 0;
+}
+
+int storage_mkdir(const char* path, mode_t mode) {
+  filepath fp = to_filepath(path);
+
+  if (streq(fp.crumbs, SNAPSHOT_DIR)) {
+    return storage_snapshot(fp.file);
+  }
+
+  int rv = storage_mknod(path, __S_IFDIR | mode);
+  if (rv != 0) {
+    return rv == -EROFS || rv == -ENAMETOOLONG ? rv : -ENOSPC;
+  }
+
+  int dirIdx = tree_lookup(path);
+  int parentIdx = tree_lookup(fp.crumbs);
+
+  inode* dir = get_inode(dirIdx);
+
+  directory_put(dir, ".", dirIdx);
+  directory_put(dir, "..", parentIdx);
+
+  return rv;
+}
+
+int storage_rmdir(const char* path) {
+  int dirIdx = tree_lookup(path);
+  if (dirIdx < 0) {
+    return -ENOENT;
+  }
+
+  filepath fp = to_filepath(path);
+  int parentIdx = tree_lookup(fp.crumbs);
+
+  // Snapshot roots can be removed, anything inside them cannot
+  if (is_readonly(parentIdx)) {
+    return -EROFS;
+  }
+
+  inode* dir = get_inode(dirIdx);
+  inode* parent = get_inode(parentIdx);
+
+  if (is_folder(dir->mode)) {
+    int rv = directory_delete(parent, fp.file);
+    drop_link(dirIdx);
+    return rv;
+  } else {
+    return -ENOTDIR;
+  }
+}
+
+int storage_chmod(const char* path, mode_t mode) {
+  int fileIdx = tree_lookup(path);
+
+  if (fileIdx < 0) {
+    return -ENOENT;
+  }
+
+  if (is_readonly(fileIdx)) {
+    return -EROFS;
+  }
+
+  inode* file = get_inode(fileIdx);
+  file->mode = mode;
+  timestamps_touch(fileIdx, TIME_CTIME);
+
+  return 0;
+}
+
+typedef struct snapshot_ctx {
+  int copyIdx; // the directory being filled
+  int parentIdx; // the copy's parent, for ..
+  int isRoot; // whether the source is the live root, which holds SNAPSHOT_DIR
+  int* clones; // original inode -> copy, so hard links stay linked
+} snapshot_ctx;
+
+static int snapshot_tree(int inum, int parentIdx, int* clones);
+
+static int snapshot_entry(const char* name, int inum, void* arg) {
+  snapshot_ctx* ctx = arg;
+  inode* copy = get_inode(ctx->copyIdx);
+
+  if (streq(name, ".")) {
+    return directory_put(copy, name, ctx->copyIdx);
+  } else if (streq(name, "..")) {
+    return directory_put(copy, name, ctx->parentIdx);
+  } else if (ctx->isRoot && streq(name, SNAPSHOT_DIR + 1)) {
+    // Snapshots don't contain older snapshots
+    return 0;
+  }
+
+  int childIdx = snapshot_tree(inum, ctx->copyIdx, ctx->clones);
+  if (childIdx < 0) {
+    return childIdx;
+  }
+
+  return directory_put(copy, name, childIdx);
+}
+
+// Copies the metadata of the tree at inum into read-only inodes, sharing data pages
+static int snapshot_tree(int inum, int parentIdx, int* clones) {
+  if (clones[inum] >= 0) {
+    return clones[inum];
+  }
+
+  int copyIdx = alloc_inode();
+  if (copyIdx < 0) {
+    return -ENOSPC;
+  }
+  clones[inum] = copyIdx;
+
+  inode* src = get_inode(inum);
+  inode* copy = get_inode(copyIdx);
+  copy->refs = src->refs;
+  copy->mode = src->mode;
+  copy->atime = src->atime;
+  copy->mtime = src->mtime;
+  copy->ctime = src->ctime;
+
+  int rv;
+  if (is_folder(src->mode)) {
+    // Directory pages hold inode indices, so they are copied rather than shared
+    int pageIdx = alloc_page();
+    if (pageIdx < 0) {
+      return -ENOSPC;
+    }
+    copy->ptrs[0] = pageIdx;
+    copy->size = PAGE_SIZE;
+
+    snapshot_ctx ctx = { copyIdx, parentIdx, inum == 0, clones };
+    rv = directory_foreach(src, snapshot_entry, &ctx);
+  } else {
+    rv = share_inode(copy, src);
+  }
+
+  copy->flags |= INODE_READONLY;
+
+  return rv < 0 ? rv : copyIdx;
+}
+
+typedef struct snapshot_cost {
+  int snapshotsIdx; // SNAPSHOT_DIR, which snapshots leave out
+  char* seen; // inodes already counted, so hard links count once
+  int inodes; // inodes the copies take, chained ones included
+  int pages; // directory pages the copies take
+} snapshot_cost;
+
+static void snapshot_count(int inum, snapshot_cost* cost);
+
+static int snapshot_count_entry(const char* name, int inum, void* arg) {
+  snapshot_cost* cost = arg;
+
+  if (!streq(name, ".") && !streq(name, "..") && inum != cost->snapshotsIdx) {
+    snapshot_count(inum, cost);
+  }
+  return 0;
+}
+
+// Adds up what snapshot_tree takes to copy the tree at inum, so a snapshot that
+// doesn't fit fails before anything is copied
+static void snapshot_count(int inum, snapshot_cost* cost) {
+  if (cost->seen[inum]) {
+    return;
+  }
+  cost->seen[inum] = 1;
+
+  inode* src = get_inode(inum);
+  for (inode* node = src; node != 0; node = node->iptr ? get_inode(node->iptr) : 0) {
+    cost->inodes++;
+  }
+
+  if (is_folder(src->mode)) {
+    cost->pages += max(bytes_to_pages(src->size), 1);
+    directory_foreach(src, snapshot_count_entry, cost);
+  }
+}
+
+int storage_snapshot(const char* name) {
+  int snapshotsIdx = tree_lookup(SNAPSHOT_DIR);
+  if (snapshotsIdx < 0) {
+    int rv = storage_mkdir(SNAPSHOT_DIR, 0755);
+    if (rv != 0) {
+      return rv;
+    }
+    snapshotsIdx = tree_lookup(SNAPSHOT_DIR);
+  }
+
+  inode* snapshots = get_inode(snapshotsIdx);
+  if (streq(name, "") || directory_lookup(snapshots, name) != 0) {
+    return -EEXIST;
+  }
+
+  // Every inode and directory page of the live tree is copied, and running out
+  // halfway would only copy the start of it before being undone
+  snapshot_cost cost = { snapshotsIdx, calloc(INODE_COUNT, 1), 0, 0 };
+  snapshot_count(0, &cost);
+  free(cost.seen);
+
+  superblock* sb = get_superblock();
+  if (cost.inodes > sb->free_inodes || cost.pages > sb->free_pages) {
+    return -ENOSPC;
+  }
+
+  int* clones = malloc(INODE_COUNT * sizeof(int));
+  for (int ii = 0; ii < INODE_COUNT; ii++) {
+    clones[ii] = -1;
+  }
+
+  // Snapshots copy timestamps straight from the inode table
+  timestamps_flush(-1);
+  int rootIdx = snapshot_tree(0, snapshotsIdx, clones);
+  int rv = rootIdx < 0 ? rootIdx : directory_put(snapshots, name, rootIdx);
+
+  if (rv < 0) {
+    // Undo a partial snapshot, dropping the page references it took
+    for (int ii = 0; ii < INODE_COUNT; ii++) {
+      if (clones[ii] >= 0) {
+        free_inode(clones[ii]);
+      }
+    }
+  }
+
+  free(clones);
+  return rv < 0 ? rv : 0;
+}
+
+filepath to_filepath(const char* path) {
+    filepath ret;
+    strcpy(ret.crumbs, "/");
+
+    assert(*path == '/');
+
+    slist* tokens = s_split(path, '/');
+
+    while (tokens != 0) {
+        if (tokens->next == 0) {
+            strncpy(ret.file, tokens->data, sizeof(ret.file) - 1);
+            ret.file[sizeof(ret.file) - 1] = 0;
+        } else {
+            join_to_path(ret.crumbs, tokens->data);
+        }
+
+        tokens = tokens->next;
+    }
+
+    s_free(tokens);
+
+    return ret;
+}
@@ -6,17 +6,45 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <time.h>
 
+#include "readahead.h"
 #include "slist.h"
 
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0) // fail if the target exists
+#define RENAME_EXCHANGE (1 << 1) // atomically swap the source and target
+#endif
+
+#define SNAPSHOT_DIR "/.snapshots" // mkdir inside this directory takes a snapshot
+
+// A byte range of the image file, for handing data to FUSE without copying it
+typedef struct storage_extent {
+    int fd; // the backing file, a striped image has several
+    off_t pos;
+    size_t size;
+} storage_extent;
+
+// Pages kept from being reused while FUSE splices from them, see storage_read_extents
+typedef struct storage_pins {
+    int* pnums;
+    int count;
+    int cap;
+} storage_pins;
+
 typedef struct filepath {
-    char file[255]; // max length of a filename is 255 chars
+    char file[256]; // max length of a filename is 255 chars
     char crumbs[4096]; // max length of a pathname is 4096 chars
 } filepath;
 
 void   storage_init(const char* path);
+void   storage_start(); // starts background threads, call after daemonizing
+void   storage_stop(); // stops background threads and marks the image clean
+void   storage_lock(); // held around every storage call once threads are started
+void   storage_unlock();
 int    storage_stat(const char* path, struct stat* st);
+int    storage_statfs(struct statvfs* st);
 int    storage_read(const char* path, char* buf, size_t size, off_t offset);
 int    storage_write(const char* path, const char* buf, size_t size, off_t offset);
 int    storage_truncate(const char *path, off_t size);
@@ -25,14 +53,141 @@ int    storage_unlink(const char* path);
 int    storage_link(const char *from, const char *to);
 int    storage_symlink(const char* to, const char* from);
 int    storage_readlink(const char* path, char* buf, size_t size);
-int    storage_rename(const char *from, const char *to);
+int    storage_rename(const char *from, const char *to, unsigned int flags);
 int    storage_set_time(const char* path, const struct timespec ts[2]);
 int    storage_access(const char*path, int mask);
 slist* storage_list(const char* path);
+
+/**
+ * @brief Calls a function with the name and attributes of every entry in a
+ *        directory, stopping early if it returns nonzero.
+ * 
+ * @param path the directory
+ * @param fn the function to call with each entry's name, stat and arg
+ * @param arg passed through to fn
+ * @return int 0 if successful, ENOENT if the directory doesn't exist, ENOTDIR if
+ *         it isn't a directory
+ */
+int    storage_readdir(const char* path,
+                       int (*fn)(const char* name, const struct stat* st, void* arg),
+                       void* arg);
 int    storage_mkdir(const char* path, mode_t mode);
 int    storage_rmdir(const char* path);
 int    storage_chmod(const char* path, mode_t mode);
 
+/**
+ * @brief Copies a range of one file into another. Page-aligned ranges share pages
+ *        copy-on-write instead of copying bytes.
+ * 
+ * @param from the source file
+ * @param fromOffset where to start reading from
+ * @param to the destination file
+ * @param toOffset where to start writing to
+ * @param size the number of bytes to copy, clamped to the end of the source
+ * @return int the number of bytes copied, or a negative error
+ */
+int    storage_copy_range(const char* from, off_t fromOffset, const char* to,
+                          off_t toOffset, size_t size);
+
+/**
+ * @brief Replaces the contents of a file with a copy-on-write clone of another.
+ * 
+ * @param from the source file
+ * @param to the destination file, which must already exist
+ * @return int 0 if successful, or a negative error
+ */
+int    storage_clone(const char* from, const char* to);
+
+/**
+ * @brief Finishes deferred work on a file after it was written to and closed.
+ * 
+ * @param path the file
+ * @return int 0 if successful, ENOENT if the file doesn't exist
+ */
+int    storage_flush(const char* path);
+
+/**
+ * @brief Writes a file's pending timestamp updates back and syncs the image to
+ *        disk.
+ * 
+ * @param path the file
+ * @return int 0 if successful, ENOENT if the file doesn't exist
+ */
+int    storage_fsync(const char* path);
+
+/**
+ * @brief Passes an madvise hint for every page a file currently owns.
+ * 
+ * @param path the file
+ * @param advice an MADV_* constant
+ * @return int 0 if successful, ENOENT if the file doesn't exist
+ */
+int    storage_advise(const char* path, int advice);
+
+/**
+ * @brief Feeds a completed read into an open file's readahead state.
+ * 
+ * @param path the file
+ * @param ra the state kept for this open file
+ * @param offset where the read started
+ * @param size the number of bytes read
+ * @return int 0 if successful, ENOENT if the file doesn't exist
+ */
+/**
+ * @brief Finds where a range of a file lives in the image, so it can be spliced
+ *        straight out of the image file. The data can change once the storage
+ *        lock is released, like any read racing a write, but pinned pages aren't
+ *        handed to another file even if this one lets go of them.
+ * 
+ * @param path the file
+ * @param size the number of bytes wanted
+ * @param offset where to start
+ * @param extents filled with size / PAGE_SIZE + 2 entries at most
+ * @param pins the pages are pinned and added here, 0 if the extents are only
+ *        used under the storage lock
+ * @return int the number of extents, 0 at the end of the file, ENOENT if the file
+ *         doesn't exist, ENOTSUP if the file is compressed and must be read with
+ *         storage_read
+ */
+int    storage_read_extents(const char* path, size_t size, off_t offset,
+                            storage_extent* extents, storage_pins* pins);
+
+/**
+ * @brief Unpins the pages of earlier reads once FUSE is done with them, and empties
+ *        the list. Called under the storage lock.
+ * 
+ * @param pins the pages to unpin
+ */
+void   storage_unpin(storage_pins* pins);
+
+/**
+ * @brief Makes room for a write and finds where it lives in the image, so the data
+ *        can be spliced straight into the image file. Shared pages are copied first.
+ * 
+ * @param path the file
+ * @param size the number of bytes to be written
+ * @param offset where the write starts
+ * @param extents filled with size / PAGE_SIZE + 2 entries at most
+ * @return int the number of extents, ENOENT if the file doesn't exist, EROFS in a
+ *         snapshot, ENOSPC if out of pages
+ */
+int    storage_write_extents(const char* path, size_t size, off_t offset,
+                             storage_extent* extents);
+
+int    storage_readahead(const char* path, readahead_state* ra, off_t offset, size_t size);
+
+/**
+ * @brief Takes a read-only snapshot of the filesystem at SNAPSHOT_DIR/name. Data
+ *        pages are shared with the live tree and copied only when written, but
+ *        every inode and directory page is copied, and nothing is if they don't
+ *        all fit.
+ * 
+ * @param name the name of the snapshot
+ * @return int 0 if successful, EEXIST if the snapshot exists, ENOSPC if out of
+ *         pages or inodes for the snapshot's metadata
+ */
+int    storage_snapshot(const char* name);
+
 /**
  * @brief Converts a full path into a filepath struct for easier access to the file's
  *        name and the breadcrumbs leading up to it.
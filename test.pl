@@ -2,11 +2,14 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 69;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts, $image) = @_;
+    $opts = $opts ? "MOUNT_OPTS='-o $opts'" : "";
+    $opts .= $image ? " IMAGE=$image" : "";
+    system("(make mount $opts 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -41,7 +44,7 @@ sub read_text_slice {
     return $data;
 }
 
-system("rm -f data.nufs test.log");
+system("rm -f data.nufs mkfs.nufs replay.nufs trace.bin stripe*.nufs slow.nufs test.log");
 
 say "#           == Basic Tests ==";
 mount();
@@ -187,4 +190,241 @@ mount();
 my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
+say "#           == Snapshot Tests ==";
+
+system("mkdir -p mnt/.snapshots/snap1");
+ok(-d "mnt/.snapshots/snap1/numbers", "took a snapshot");
+
+write_text("numbers/10.num", "changed");
+my $snap0 = read_text(".snapshots/snap1/numbers/10.num");
+ok($snap0 eq "10", "snapshot keeps old data");
+my $snap1 = read_text("numbers/10.num");
+ok($snap1 eq "changed", "live tree has new data");
+
+ok(!open(my $rofh, ">", "mnt/.snapshots/snap1/numbers/20.num"), "snapshot is read-only");
+
+system("rmdir mnt/.snapshots/snap1");
+ok(!-d "mnt/.snapshots/snap1", "deleted snapshot");
+
+say "#           == Clone Tests ==";
+
+my $NUFS_IOC_CLONE = (1 << 30) | (4120 << 16) | (ord('N') << 8) | 1;
+open my $cfh, ">", "mnt/clone.txt";
+ok(ioctl($cfh, $NUFS_IOC_CLONE, pack("Z4096 q q q", "/40k.txt", 0, 0, 0)), "cloned a file");
+close $cfh;
+my $clone0 = read_text("clone.txt");
+ok($clone0 eq $huge0, "Read back clone");
+
+# A zero length copies to the end of the source
+open $cfh, ">", "mnt/tail.txt";
+ok(ioctl($cfh, $NUFS_IOC_CLONE, pack("Z4096 q q q", "/40k.txt", 4096, 0, 4096)), "cloned the tail of a file");
+close $cfh;
+my $tail0 = read_text("tail.txt");
+ok($tail0 eq ("\0" x 4096) . substr($huge0, 4096), "Read back tail clone");
+
+say "#           == Dedup Tests ==";
+
+write_text("dup1.txt", $huge0);
+write_text("dup2.txt", $huge0);
+my $NUFS_IOC_DEDUP = (2 << 30) | (24 << 16) | (ord('N') << 8) | 2;
+my $dres = "\0" x 24;
+open my $dfh, "<", "mnt/dup1.txt";
+ok(ioctl($dfh, $NUFS_IOC_DEDUP, $dres), "ran dedup scan");
+close $dfh;
+my ($scanned, $merged) = unpack("q q q", $dres);
+ok($merged > 0, "merged duplicate pages");
+my $dup0 = read_text("dup2.txt");
+ok($dup0 eq $huge0, "Read back deduplicated file");
+
+say "#           == Rename Tests ==";
+
+system("mv mnt/foo/abc.txt mnt/dir1/moved.txt");
+ok(-e "mnt/dir1/moved.txt" && !-e "mnt/foo/abc.txt", "moved across directories");
+my $mv0 = read_text("dir1/moved.txt");
+ok($mv0 eq $msg2, "Read back data after move");
+
+write_text("tmp.txt", "replacement");
+system("mv mnt/tmp.txt mnt/dir1/moved.txt");
+my $mv1 = read_text("dir1/moved.txt");
+ok($mv1 eq "replacement", "rename replaced the target");
+
+say "#           == Statfs Tests ==";
+
+my ($total, $free0) = split ' ', `stat -f -c '%b %f' mnt`;
+ok($total == 256, "statfs reports the image size");
+write_text("statfs.txt", $huge0);
+my (undef, $free1) = split ' ', `stat -f -c '%b %f' mnt`;
+ok($free1 < $free0, "statfs free count drops after a write");
+
+say "#           == Stats Tests ==";
+
+my $stats = read_text(".nufs/stats");
+ok($stats =~ /"getattr": \{"count": [1-9]/ && $stats =~ /"free_pages": \d+/, "stats file reports operation counts");
+my $metrics = read_text(".nufs/metrics");
+ok($metrics =~ /^nufs_op_duration_seconds_count\{op="tree_lookup"\} [1-9]/m, "metrics file is in Prometheus format");
+
+say "#           == Timestamp Tests ==";
+
+my $mtime0 = `stat -c %Y mnt/statfs.txt`;
+unmount();
+mount();
+my $mtime1 = `stat -c %Y mnt/statfs.txt`;
+ok($mtime0 == $mtime1 && $mtime1 > 0, "modification time survives a remount");
+
+unmount();
+
+ok(system("./nufs-fsck data.nufs >> test.log") == 0, "fsck finds no errors after unmount");
+
+ok(system("./nufs-mkfs -s 4M -N 512 mkfs.nufs >> test.log && ./nufs-fsck mkfs.nufs >> test.log") == 0,
+   "mkfs makes a consistent image");
+ok(system("./nufs-mkfs -s 16M -b 64K mkfs.nufs >> test.log && ./nufs-fsck mkfs.nufs >> test.log") == 0,
+   "mkfs makes a consistent image with 64K pages");
+
+say "#           == Long Name Tests ==";
+
+system("./nufs-mkfs data.nufs >> test.log");
+mount();
+
+my $long = "n" x 200;
+write_text($long, "long name");
+ok(read_text($long) eq "long name", "Read back a file with a 200-byte name");
+for my $ii (1..100) {
+    write_text("many$ii.txt", $ii);
+}
+unlink("mnt/many$_.txt") for grep { $_ % 2 } (1..100);
+my @left = glob("mnt/many*.txt");
+ok(@left == 50 && read_text("many50.txt") eq "50", "entries survive deletes around them");
+my ($lsSize) = `ls -l mnt` =~ /^\S+\s+\d+\s+\S+\s+\S+\s+(\d+).*many50\.txt$/m;
+ok(defined($lsSize) && $lsSize == 3, "ls -l reports the sizes of listed files");
+
+unmount();
+
+ok(system("./nufs-fsck data.nufs >> test.log") == 0, "fsck finds no errors with variable-length entries");
+
+say "#           == Trace Tests ==";
+
+system("./nufs-mkfs data.nufs >> test.log && cp data.nufs replay.nufs");
+mount("trace=trace.bin");
+
+system("mkdir -p mnt/traced/sub");
+write_text("traced/sub/one.txt", "traced");
+system("mv mnt/traced/sub/one.txt mnt/traced/two.txt");
+ok(read_text("traced/two.txt") eq "traced", "Read back a file while tracing");
+
+unmount();
+
+my $replay = `./nufs-replay trace.bin replay.nufs 2>> test.log`;
+ok($replay =~ /^nufs-replay: [1-9]\d* operations/m && system("./nufs-fsck replay.nufs >> test.log") == 0,
+   "replaying a trace leaves a consistent image");
+
+say "#           == Striping Tests ==";
+
+my $stripes = "data.nufs,stripe1.nufs,stripe2.nufs";
+system("./nufs-mkfs -s 4M -S 16K $stripes >> test.log");
+mount("", $stripes);
+
+my $striped = join("", map { chr(ord("a") + $_ % 26) } (1..100000));
+write_text("striped.txt", $striped);
+ok(read_text("striped.txt") eq $striped, "Read back a file striped over three files");
+
+unmount();
+
+ok((stat("stripe1.nufs"))[12] > 0 && (stat("stripe2.nufs"))[12] > 0 &&
+   system("./nufs-fsck $stripes >> test.log") == 0,
+   "a large file lands on every stripe and fsck finds no errors");
+
+say "#           == Tiering Tests ==";
+
+my $tiers = "data.nufs,slow.nufs";
+system("./nufs-mkfs -s 4M -T 256K $tiers >> test.log");
+mount("", $tiers);
+
+my $tiered = "tiered " x 50000;
+write_text("tiered.txt", $tiered);
+read_text("tiered.txt") for (1..3);
+ok(read_text("tiered.txt") eq ($tiered =~ s/\s*$//r), "Read back a file larger than the fast tier");
+my $tierStats = read_text(".nufs/stats");
+ok($tierStats =~ /"tier_slow_hits": [1-9]/ && $tierStats =~ /"tier_fast_hit_rate": 0\.\d+/,
+   "stats report hits on each tier");
+
+unmount();
+
+say "#           == Compression Tests ==";
+
+system("./nufs-mkfs data.nufs >> test.log");
+mount("compress");
+
+my $squeezed = "compress me " x 10000;
+write_text("squeezed.txt", $squeezed);
+ok(read_text(".nufs/stats") =~ /"compress_bytes_out": [1-9]/, "a closed file is stored compressed");
+ok(read_text("squeezed.txt") eq ($squeezed =~ s/\s*$//r), "Read back a compressed file");
+
+my $rewritten = "rewritten " x 10000;
+write_text("squeezed.txt", $rewritten);
+ok(read_text("squeezed.txt") eq ($rewritten =~ s/\s*$//r), "Read back a compressed file overwritten after close");
+
+# The new file can reuse the inode of the old one, cached clusters included
+write_text("gone.txt", "gone " x 10000);
+read_text("gone.txt");
+unlink("mnt/gone.txt");
+sleep 1;
+my $reused = "reused " x 10000;
+write_text("reused.txt", $reused);
+ok(read_text("reused.txt") eq ($reused =~ s/\s*$//r), "Read back a compressed file in a reused inode");
+
+unmount();
+
+ok(system("./nufs-fsck data.nufs >> test.log") == 0, "fsck accepts compressed files");
+system("./nufs-fsck -r data.nufs >> test.log");
+mount("compress");
+ok(read_text("squeezed.txt") eq ($rewritten =~ s/\s*$//r), "fsck -r leaves compressed files whole");
+unmount();
+
+say "#           == Dedup Reuse Tests ==";
+
+system("./nufs-mkfs data.nufs >> test.log");
+mount();
+
+sub write_zeros {
+    my ($name) = @_;
+    open my $fh, ">", "mnt/$name" or return;
+    print $fh "\0" x 4096;
+    close $fh;
+}
+
+sub dedup_scan {
+    my $res = "\0" x 24;
+    open my $fh, "<", "mnt/zeros.bin" or return 0;
+    my $rv = ioctl($fh, $NUFS_IOC_DEDUP, $res);
+    close $fh;
+    return $rv;
+}
+
+# Index the page of a file, then free it so the next page a directory grows by
+# is that same page, now holding nothing but zeros once its entry is moved out
+mkdir "mnt/src";
+mkdir "mnt/dir";
+write_zeros("zeros.bin");
+dedup_scan();
+my $longName = "n" x 200;
+for my $ii (0..39) {
+    open my $fh, ">", "mnt/src/$ii$longName";
+    close $fh;
+}
+unlink("mnt/zeros.bin");
+sleep 1;
+
+my $moved = 0;
+while (-s "mnt/dir" <= 4096 && $moved < 40) {
+    rename("mnt/src/$moved$longName", "mnt/dir/$moved$longName");
+    ++$moved;
+}
+--$moved;
+rename("mnt/dir/$moved$longName", "mnt/src/$moved$longName");
+
+write_zeros("zeros.bin");
+ok(dedup_scan(), "ran dedup scan over a reused page");
+rename("mnt/src/$moved$longName", "mnt/dir/$moved$longName");
+ok(read_text_slice("zeros.bin", 4096, 0) eq "\0" x 4096, "a freed page reused by a directory is never shared");
+
 unmount();
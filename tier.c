@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "inode.h"
+#include "pages.h"
+#include "storage.h"
+#include "util.h"
+
+#include "tier.h"
+
+const int TIER_BATCH = 64; // inodes swept per hold of the storage lock
+
+// Accesses per page since the last sweeps, halved after each one
+static uint8_t* heat = 0;
+static tier_stats totals;
+
+// Where the sweep is, and how it's going for the fast tier
+static int cursor = 0;
+static int fastFree = -1; // counted at the start of every sweep
+static int fastReserve = 0; // cold pages are demoted while fewer are free
+static int waiting = 0; // hot slow pages that didn't fit during this sweep
+static int nextFast = 0; // no free fast page below this one during this sweep
+static int nextSlow = 0; // and the same for slow pages
+
+static pthread_t thread;
+static pthread_mutex_t wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+
+static void heat_init() {
+  if (heat == 0) {
+    heat = calloc(PAGE_COUNT, 1);
+  }
+}
+
+void tier_touch(int pnum) {
+  int fastPages = get_superblock()->tier_pages;
+  if (fastPages == 0) {
+    return;
+  }
+
+  heat_init();
+  if (heat[pnum] < UINT8_MAX) {
+    heat[pnum]++;
+  }
+
+  if (pnum < fastPages) {
+    totals.fast_hits++;
+  } else {
+    totals.slow_hits++;
+  }
+}
+
+static int count_fast_free(superblock* sb) {
+  void* pbm = get_pages_bitmap();
+  int count = 0;
+  for (int ii = sb->first_data_page; ii < sb->tier_pages; ii++) {
+    count += !bitmap_get(pbm, ii);
+  }
+  return count;
+}
+
+// Copies a page to a free one in [first, end) and points the slot at the copy
+static int move_page(int* slot, int first, int end) {
+  int dst = alloc_page_in(first, end);
+  if (dst < 0) {
+    return -1;
+  }
+
+  int src = *slot;
+  memcpy(pages_get_page(dst), pages_get_page(src), PAGE_SIZE);
+  heat[dst] = heat[src];
+  heat[src] = 0;
+  *slot = dst;
+  free_page(src);
+  return dst;
+}
+
+// Moves the direct pages of a single node, indirect nodes are visited on their own
+static void tier_node(inode* node, superblock* sb) {
+  int reserve = (sb->tier_pages - sb->first_data_page) / TIER_RESERVE;
+  int folder = is_folder(node->mode);
+
+  for (int ii = 0; ii < 5; ii++) {
+    int pnum = node->ptrs[ii];
+
+    // Pages shared with snapshots or clones have other slots pointing at them
+    if (pnum == 0 || page_refs(pnum) != 1) {
+      continue;
+    }
+
+    if (pnum < sb->tier_pages) {
+      if (!folder && heat[pnum] == 0 && fastFree < fastReserve) {
+        int dst = move_page(&node->ptrs[ii], nextSlow, PAGE_COUNT);
+        if (dst >= 0) {
+          nextSlow = dst + 1;
+          fastFree++;
+          totals.pages_demoted++;
+        }
+      }
+    } else if (folder || heat[pnum] >= TIER_HOT) {
+      int dst = fastFree > reserve ? move_page(&node->ptrs[ii], nextFast, sb->tier_pages) : -1;
+      if (dst >= 0) {
+        nextFast = dst + 1;
+        fastFree--;
+        totals.pages_promoted++;
+      } else {
+        waiting++;
+      }
+    }
+  }
+}
+
+int tier_run(int max) {
+  superblock* sb = get_superblock();
+  if (sb->tier_pages == 0) {
+    return 1;
+  }
+
+  heat_init();
+
+  // Pages freed since a sweep started may be below the cursors, which only makes
+  // a few moves wait for the next sweep. Hot pages that found the fast tier full
+  // last time get room made for them by demoting that many more cold pages.
+  if (cursor == 0) {
+    int fastPages = sb->tier_pages - sb->first_data_page;
+    fastReserve = min(fastPages / TIER_RESERVE + waiting, fastPages);
+    waiting = 0;
+    fastFree = count_fast_free(sb);
+    nextFast = sb->first_data_page;
+    nextSlow = sb->tier_pages;
+  }
+
+  int end = min(cursor + max, INODE_COUNT);
+  for (; cursor < end; cursor++) {
+    inode* node = get_inode(cursor);
+    if (node != 0) {
+      tier_node(node, sb);
+    }
+  }
+
+  if (cursor < INODE_COUNT) {
+    return 0;
+  }
+
+  for (int ii = 0; ii < PAGE_COUNT; ii++) {
+    heat[ii] >>= 1;
+  }
+  cursor = 0;
+
+  printf("+ tier_run() -> %d fast pages free, %ld promoted, %ld demoted so far\n",
+         fastFree, totals.pages_promoted, totals.pages_demoted);
+  return 1;
+}
+
+tier_stats tier_get_stats() {
+  return totals;
+}
+
+static void* tier_thread(void* arg) {
+  pthread_mutex_lock(&wakeMutex);
+  while (running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TIER_SWEEP_SECONDS;
+    pthread_cond_timedwait(&wakeCond, &wakeMutex, &deadline);
+    if (!running) {
+      break;
+    }
+    pthread_mutex_unlock(&wakeMutex);
+
+    // Sweep in small batches so FUSE callbacks can get the lock in between
+    int done;
+    do {
+      storage_lock();
+      done = tier_run(TIER_BATCH);
+      storage_unlock();
+    } while (!done && running);
+
+    pthread_mutex_lock(&wakeMutex);
+  }
+  pthread_mutex_unlock(&wakeMutex);
+
+  return 0;
+}
+
+void tier_start() {
+  if (get_superblock()->tier_pages == 0) {
+    return;
+  }
+
+  running = 1;
+  pthread_create(&thread, 0, tier_thread, 0);
+}
+
+void tier_stop() {
+  if (!running) {
+    return;
+  }
+
+  pthread_mutex_lock(&wakeMutex);
+  running = 0;
+  pthread_cond_signal(&wakeCond);
+  pthread_mutex_unlock(&wakeMutex);
+  pthread_join(thread, 0);
+}
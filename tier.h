@@ -0,0 +1,53 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+
+#define TIER_SWEEP_SECONDS 10 // how often pages are moved between tiers
+#define TIER_HOT 4 // slow pages touched this often since the last sweeps are promoted
+#define TIER_RESERVE 8 // cold pages are demoted to keep 1/TIER_RESERVE of the fast tier free
+
+typedef struct tier_stats {
+    int64_t fast_hits; // data pages read or written on the fast tier
+    int64_t slow_hits; // and on the slow one
+    int64_t pages_promoted;
+    int64_t pages_demoted;
+} tier_stats;
+
+/**
+ * @brief Records an access to a data page, which heats it up for the next sweep.
+ *        Does nothing unless the image is tiered.
+ * 
+ * @param pnum the page read or written
+ */
+void tier_touch(int pnum);
+
+/**
+ * @brief Moves the pages of some inodes between tiers, continuing from where the
+ *        last call stopped. Cold pages go to the slow tier while the fast one is
+ *        short of free pages, hot pages and directories come back while there
+ *        is room. Heat is halved at the end of every sweep over the inode table.
+ * 
+ * @param max the most inodes to look at
+ * @return int 1 if a sweep was finished, 0 if there are inodes left
+ */
+int tier_run(int max);
+
+/**
+ * @brief Gets the running totals since mount.
+ * 
+ * @return tier_stats the totals
+ */
+tier_stats tier_get_stats();
+
+/**
+ * @brief Starts the background thread that sweeps a tiered image periodically.
+ */
+void tier_start();
+
+/**
+ * @brief Stops the background thread.
+ */
+void tier_stop();
+
+#endif
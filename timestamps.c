@@ -0,0 +1,194 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "inode.h"
+#include "options.h"
+#include "storage.h"
+
+#include "timestamps.h"
+
+const int RELATIME_SECONDS = 24 * 60 * 60; // relatime still updates atimes this old
+
+typedef struct pending_times {
+  time_t atime;
+  time_t mtime;
+  time_t ctime;
+  int dirty; // TIME_* flags of the fields above that are newer than the inode's
+  int listed; // whether the inode is in dirtyList, which outlives dirty until a full flush
+} pending_times;
+
+// One slot per inode, plus a list of the dirty ones so a flush doesn't scan them all
+static pending_times* pending = 0;
+static int* dirtyList = 0;
+static int dirtyCount = 0;
+
+static pthread_t thread;
+static pthread_mutex_t wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+
+time_t timestamps_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  return now.tv_sec;
+}
+
+static pending_times* get_pending(int inum) {
+  if (pending == 0) {
+    pending = calloc(INODE_COUNT, sizeof(pending_times));
+    dirtyList = malloc(INODE_COUNT * sizeof(int));
+  }
+  return &pending[inum];
+}
+
+// Reads a timestamp as it will be once pending updates are written
+static time_t current_time(int inum, int which) {
+  pending_times* times = get_pending(inum);
+  inode* node = get_inode(inum);
+
+  if (which == TIME_ATIME) {
+    return (times->dirty & TIME_ATIME) ? times->atime : node->atime;
+  } else if (which == TIME_MTIME) {
+    return (times->dirty & TIME_MTIME) ? times->mtime : node->mtime;
+  } else {
+    return (times->dirty & TIME_CTIME) ? times->ctime : node->ctime;
+  }
+}
+
+// Whether a read should move the access time forward
+static int wants_atime(int inum, time_t now) {
+  if (options.atime == ATIME_NOATIME) {
+    return 0;
+  } else if (options.atime == ATIME_RELATIME) {
+    time_t atime = current_time(inum, TIME_ATIME);
+    return atime <= current_time(inum, TIME_MTIME) ||
+           atime <= current_time(inum, TIME_CTIME) ||
+           now - atime >= RELATIME_SECONDS;
+  }
+  return 1;
+}
+
+void timestamps_touch(int inum, int which) {
+  if (get_inode(inum) == 0) {
+    return;
+  }
+
+  time_t now = timestamps_now();
+  if ((which & TIME_ATIME) && !wants_atime(inum, now)) {
+    which &= ~TIME_ATIME;
+  }
+  if (which == 0) {
+    return;
+  }
+
+  pending_times* times = get_pending(inum);
+  if (!times->listed) {
+    dirtyList[dirtyCount++] = inum;
+    times->listed = 1;
+  }
+
+  if (which & TIME_ATIME) {
+    times->atime = now;
+  }
+  if (which & TIME_MTIME) {
+    times->mtime = now;
+  }
+  if (which & TIME_CTIME) {
+    times->ctime = now;
+  }
+  times->dirty |= which;
+}
+
+void timestamps_fill(int inum, struct stat* st) {
+  st->st_atime = current_time(inum, TIME_ATIME);
+  st->st_mtime = current_time(inum, TIME_MTIME);
+  st->st_ctime = current_time(inum, TIME_CTIME);
+}
+
+static void write_back(int inum) {
+  pending_times* times = get_pending(inum);
+  inode* node = get_inode(inum);
+
+  if (node != 0) {
+    if (times->dirty & TIME_ATIME) {
+      node->atime = times->atime;
+    }
+    if (times->dirty & TIME_MTIME) {
+      node->mtime = times->mtime;
+    }
+    if (times->dirty & TIME_CTIME) {
+      node->ctime = times->ctime;
+    }
+  }
+  times->dirty = 0;
+}
+
+void timestamps_flush(int inum) {
+  if (pending == 0) {
+    return;
+  }
+
+  if (inum >= 0) {
+    if (pending[inum].dirty) {
+      write_back(inum);
+    }
+    // The stale list entry is skipped by the next full flush
+    return;
+  }
+
+  int written = 0;
+  for (int ii = 0; ii < dirtyCount; ii++) {
+    pending_times* times = &pending[dirtyList[ii]];
+    if (times->dirty) {
+      write_back(dirtyList[ii]);
+      written++;
+    }
+    times->listed = 0;
+  }
+  dirtyCount = 0;
+
+  if (written > 0) {
+    printf("+ timestamps_flush() -> %d inodes\n", written);
+  }
+}
+
+void timestamps_forget(int inum) {
+  if (pending != 0) {
+    pending[inum].dirty = 0;
+  }
+}
+
+static void* timestamps_thread(void* arg) {
+  pthread_mutex_lock(&wakeMutex);
+  while (running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TIMESTAMPS_FLUSH_SECONDS;
+    pthread_cond_timedwait(&wakeCond, &wakeMutex, &deadline);
+    pthread_mutex_unlock(&wakeMutex);
+
+    storage_lock();
+    timestamps_flush(-1);
+    storage_unlock();
+
+    pthread_mutex_lock(&wakeMutex);
+  }
+  pthread_mutex_unlock(&wakeMutex);
+
+  return 0;
+}
+
+void timestamps_start() {
+  running = 1;
+  pthread_create(&thread, 0, timestamps_thread, 0);
+}
+
+void timestamps_stop() {
+  pthread_mutex_lock(&wakeMutex);
+  running = 0;
+  pthread_cond_signal(&wakeCond);
+  pthread_mutex_unlock(&wakeMutex);
+  pthread_join(thread, 0);
+}
@@ -0,0 +1,63 @@
+#ifndef TIMESTAMPS_H
+#define TIMESTAMPS_H
+
+#include <sys/stat.h>
+#include <time.h>
+
+#define TIME_ATIME 0x1
+#define TIME_MTIME 0x2
+#define TIME_CTIME 0x4
+
+#define TIMESTAMPS_FLUSH_SECONDS 30 // how long an update can stay in memory
+
+/**
+ * @brief Gets the current time from the coarse clock, which is cheap enough to
+ *        call on every operation.
+ * 
+ * @return time_t the current time in seconds
+ */
+time_t timestamps_now();
+
+/**
+ * @brief Sets an inode's timestamps to now. The new values are kept in memory
+ *        and written to the inode table later, so touching an inode doesn't dirty
+ *        its page. Access times follow the noatime/relatime mount options.
+ * 
+ * @param inum the index of the inode
+ * @param which TIME_* flags for the timestamps to update
+ */
+void timestamps_touch(int inum, int which);
+
+/**
+ * @brief Fills in a stat's timestamps, including updates not yet written back.
+ * 
+ * @param inum the index of the inode
+ * @param st where to put the timestamps
+ */
+void timestamps_fill(int inum, struct stat* st);
+
+/**
+ * @brief Writes pending timestamp updates to the inode table.
+ * 
+ * @param inum the index of the inode, or -1 for every inode
+ */
+void timestamps_flush(int inum);
+
+/**
+ * @brief Drops pending updates for an inode that is being freed.
+ * 
+ * @param inum the index of the inode
+ */
+void timestamps_forget(int inum);
+
+/**
+ * @brief Starts the background thread that writes updates back periodically.
+ */
+void timestamps_start();
+
+/**
+ * @brief Stops the background thread, writing back everything still pending.
+ */
+void timestamps_stop();
+
+#endif
@@ -0,0 +1,493 @@
+// nufs-fsck: checks an unmounted image and optionally repairs it
+//
+// usage: nufs-fsck [-r] [-j threads] image[,image...]
+//
+// The inode table is scanned by several threads at once. Each thread counts
+// page references and claims indirect nodes for the inodes in its slice, then
+// walks the chains and directory entries of the files and directories in that
+// slice. Reachability is worked out from the collected directory entries
+// afterwards, starting at the root and the orphan list.
+//
+// Exits 0 if the image is consistent, 1 if errors were repaired and 4 if
+// errors were left in place.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "compress.h"
+#include "directory.h"
+#include "inode.h"
+#include "pages.h"
+#include "rebuild.h"
+#include "util.h"
+
+typedef struct fsck_edge {
+  int dir;
+  int inum;
+  int* entry; // the entry's inode number in the directory page
+} fsck_edge;
+
+typedef struct fsck_thread {
+  pthread_t thread;
+  int first; // the slice of the inode table this thread covers
+  int end;
+  fsck_edge* edges; // named entries of the directories in the slice
+  int edgeCount;
+  int edgeCap;
+  int* cuts; // inodes whose iptr should be cleared
+  int cutCount;
+  int cutCap;
+  uint8_t* seen; // scratch for finding loops, INODE_COUNT bytes
+} fsck_thread;
+
+static int firstData;
+static uint32_t* pageCounts; // pointers to each page from allocated inodes
+static int* chainOwner; // lowest inode whose iptr points at each inode, or INODE_COUNT
+static uint8_t* chainReached; // indirect nodes reached from the start of a chain
+static int* linkCounts; // named entries pointing at each inode from reachable directories
+static uint8_t* reachable;
+
+static int errors = 0;
+static pthread_mutex_t reportMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void problem(const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+
+  pthread_mutex_lock(&reportMutex);
+  errors++;
+  printf("nufs-fsck: ");
+  vprintf(fmt, args);
+  printf("\n");
+  pthread_mutex_unlock(&reportMutex);
+
+  va_end(args);
+}
+
+static void add_cut(fsck_thread* tt, int inum) {
+  if (tt->cutCount == tt->cutCap) {
+    tt->cutCap = tt->cutCap > 0 ? 2 * tt->cutCap : 16;
+    tt->cuts = realloc(tt->cuts, tt->cutCap * sizeof(int));
+  }
+  tt->cuts[tt->cutCount++] = inum;
+}
+
+static void add_edge(fsck_thread* tt, int dir, int inum, int* entry) {
+  if (tt->edgeCount == tt->edgeCap) {
+    tt->edgeCap = tt->edgeCap > 0 ? 2 * tt->edgeCap : 64;
+    tt->edges = realloc(tt->edges, tt->edgeCap * sizeof(fsck_edge));
+  }
+  tt->edges[tt->edgeCount++] = (fsck_edge){dir, inum, entry};
+}
+
+static int is_valid_page(int pnum) {
+  return pnum >= firstData && pnum < PAGE_COUNT;
+}
+
+// Counts page references and claims the targets of indirect pointers
+static void* scan_inodes(void* arg) {
+  fsck_thread* tt = arg;
+
+  for (int inum = tt->first; inum < tt->end; inum++) {
+    inode* node = get_inode(inum);
+    if (node == 0) {
+      continue;
+    }
+
+    for (int ii = 0; ii < 5; ii++) {
+      int pnum = node->ptrs[ii];
+      if (pnum == 0) {
+        continue;
+      }
+
+      if (is_valid_page(pnum)) {
+        __atomic_fetch_add(&pageCounts[pnum], 1, __ATOMIC_RELAXED);
+      } else {
+        problem("inode %d points at invalid page %d", inum, pnum);
+      }
+    }
+
+    int next = node->iptr;
+    if (next == 0) {
+      continue;
+    }
+
+    if (next < 0 || next >= INODE_COUNT || get_inode(next) == 0) {
+      problem("inode %d has an indirect pointer to free inode %d", inum, next);
+      add_cut(tt, inum);
+      continue;
+    }
+
+    // The lowest claimant keeps the node, so the result doesn't depend on timing
+    int owner = __atomic_load_n(&chainOwner[next], __ATOMIC_RELAXED);
+    while (inum < owner &&
+           !__atomic_compare_exchange_n(&chainOwner[next], &owner, inum, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+
+  return 0;
+}
+
+static int is_head(int inum) {
+  return get_inode(inum) != 0 && chainOwner[inum] == INODE_COUNT;
+}
+
+typedef struct scan_ctx {
+  fsck_thread* tt;
+  int dir;
+} scan_ctx;
+
+static int scan_entry(const char* name, int* entry, void* arg) {
+  scan_ctx* ctx = arg;
+  if (streq(name, ".") || streq(name, "..")) {
+    return 0;
+  }
+
+  if (!is_head(*entry)) {
+    problem("directory %d has an entry for missing inode %d", ctx->dir, *entry);
+  }
+  add_edge(ctx->tt, ctx->dir, *entry, entry);
+  return 0;
+}
+
+// Walks each chain from its first inode, and collects directory entries
+static void* scan_heads(void* arg) {
+  fsck_thread* tt = arg;
+
+  for (int head = tt->first; head < tt->end; head++) {
+    if (!is_head(head)) {
+      continue;
+    }
+
+    int isDir = is_folder(get_inode(head)->mode);
+    int steps = 0;
+
+    // The root is inode 0, so a chain ends at an iptr of 0 rather than at inode 0
+    for (int inum = head;; inum = get_inode(inum)->iptr) {
+      inode* node = get_inode(inum);
+      tt->seen[inum] = 1;
+      steps++;
+
+      if (isDir) {
+        for (int ii = 0; ii < 5; ii++) {
+          if (!is_valid_page(node->ptrs[ii])) {
+            continue;
+          }
+
+          scan_ctx ctx = { tt, head };
+          directory_page_foreach(node->ptrs[ii], scan_entry, &ctx);
+        }
+      }
+
+      // Stop where the chain leaves its owner, comes back on itself or ends badly
+      int next = node->iptr;
+      if (next == 0 || next < 0 || next >= INODE_COUNT || get_inode(next) == 0) {
+        break;
+      }
+      if (chainOwner[next] != inum) {
+        problem("inode %d shares its indirect node %d with another file", inum, next);
+        add_cut(tt, inum);
+        break;
+      }
+      if (tt->seen[next]) {
+        problem("inode %d loops back to indirect node %d", inum, next);
+        add_cut(tt, inum);
+        break;
+      }
+      chainReached[next] = 1;
+    }
+
+    // A compressed file's size is what it decompresses to, its chain holds the stream
+    inode* node = get_inode(head);
+    if (!isDir && (node->flags & INODE_COMPRESSED)) {
+      int streamSize = compress_stream_size(node);
+      if (streamSize < 0) {
+        problem("compressed inode %d has a damaged stream header", head);
+      } else if (streamSize > steps * 5 * PAGE_SIZE) {
+        problem("compressed inode %d has a %d byte stream but its chain holds less",
+                head, streamSize);
+      }
+    } else if (!isDir && node->size > steps * 5 * PAGE_SIZE) {
+      problem("inode %d is %d bytes but its chain holds less", head, node->size);
+    }
+
+    // Reset the scratch marks along the same path
+    for (int inum = head; steps > 0; steps--) {
+      tt->seen[inum] = 0;
+      inum = get_inode(inum)->iptr;
+    }
+  }
+
+  return 0;
+}
+
+// By directory, then by where the entry is in the image
+static int compare_edges(const void* aa, const void* bb) {
+  const fsck_edge* ea = aa;
+  const fsck_edge* eb = bb;
+  if (ea->dir != eb->dir) {
+    return ea->dir - eb->dir;
+  }
+  return (ea->entry > eb->entry) - (ea->entry < eb->entry);
+}
+
+static void run_threads(fsck_thread* threads, int count, void* (*fn)(void*)) {
+  for (int tt = 0; tt < count; tt++) {
+    pthread_create(&threads[tt].thread, 0, fn, &threads[tt]);
+  }
+  for (int tt = 0; tt < count; tt++) {
+    pthread_join(threads[tt].thread, 0);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int repair = 0;
+  int threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "rj:")) != -1) {
+    if (opt == 'r') {
+      repair = 1;
+    } else if (opt == 'j') {
+      threadCount = atoi(optarg);
+    } else {
+      fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+      return 8;
+    }
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+    return 8;
+  }
+
+  // Every backing file of a striped image has to be there already
+  char* files = strdup(argv[optind]);
+  for (char* file = strtok(files, ","); file != 0; file = strtok(0, ",")) {
+    if (access(file, R_OK | W_OK) != 0) {
+      perror(file);
+      return 8;
+    }
+  }
+  free(files);
+
+  pages_map(argv[optind]);
+
+  superblock* sb = get_superblock();
+  if (sb->magic != NUFS_MAGIC) {
+    fprintf(stderr, "nufs-fsck: %s has no superblock, mount it once first\n", argv[optind]);
+    return 8;
+  }
+
+  threadCount = clamp(threadCount, 1, INODE_COUNT);
+  firstData = sb->first_data_page;
+  pageCounts = calloc(PAGE_COUNT, sizeof(uint32_t));
+  chainOwner = malloc(INODE_COUNT * sizeof(int));
+  chainReached = calloc(INODE_COUNT, 1);
+  linkCounts = calloc(INODE_COUNT, sizeof(int));
+  reachable = calloc(INODE_COUNT, 1);
+  for (int ii = 0; ii < INODE_COUNT; ii++) {
+    chainOwner[ii] = INODE_COUNT;
+  }
+
+  fsck_thread* threads = calloc(threadCount, sizeof(fsck_thread));
+  for (int tt = 0; tt < threadCount; tt++) {
+    threads[tt].first = (int64_t)INODE_COUNT * tt / threadCount;
+    threads[tt].end = (int64_t)INODE_COUNT * (tt + 1) / threadCount;
+    threads[tt].seen = calloc(INODE_COUNT, 1);
+  }
+
+  if (!is_head(0) || !is_folder(get_inode(0)->mode)) {
+    fprintf(stderr, "nufs-fsck: the root directory is missing\n");
+    return 8;
+  }
+
+  run_threads(threads, threadCount, scan_inodes);
+  run_threads(threads, threadCount, scan_heads);
+
+  // Gather every directory entry, grouped by directory
+  int edgeCount = 0;
+  for (int tt = 0; tt < threadCount; tt++) {
+    edgeCount += threads[tt].edgeCount;
+  }
+
+  fsck_edge* edges = malloc((edgeCount + 1) * sizeof(fsck_edge));
+  edgeCount = 0;
+  for (int tt = 0; tt < threadCount; tt++) {
+    memcpy(edges + edgeCount, threads[tt].edges, threads[tt].edgeCount * sizeof(fsck_edge));
+    edgeCount += threads[tt].edgeCount;
+  }
+  qsort(edges, edgeCount, sizeof(fsck_edge), compare_edges);
+
+  int* firstEdge = malloc((INODE_COUNT + 1) * sizeof(int));
+  for (int ii = 0, ee = 0; ii <= INODE_COUNT; ii++) {
+    while (ee < edgeCount && edges[ee].dir < ii) {
+      ee++;
+    }
+    firstEdge[ii] = ee;
+  }
+
+  // Everything reachable from the root or waiting in the orphan list is live
+  int* queue = malloc(INODE_COUNT * sizeof(int));
+  int queueLength = 0;
+  struct { int count; int inums[]; }* orphans = get_orphan_list();
+
+  reachable[0] = 1;
+  queue[queueLength++] = 0;
+  for (int ii = 0; ii < orphans->count; ii++) {
+    int inum = orphans->inums[ii];
+    if (is_head(inum) && !reachable[inum]) {
+      reachable[inum] = 1;
+      queue[queueLength++] = inum;
+    }
+  }
+
+  for (int qq = 0; qq < queueLength; qq++) {
+    int dir = queue[qq];
+    for (int ee = firstEdge[dir]; ee < firstEdge[dir + 1]; ee++) {
+      int inum = edges[ee].inum;
+      if (!is_head(inum)) {
+        continue;
+      }
+
+      linkCounts[inum]++;
+      if (!reachable[inum]) {
+        reachable[inum] = 1;
+        queue[queueLength++] = inum;
+      }
+    }
+  }
+
+  for (int inum = 1; inum < INODE_COUNT; inum++) {
+    inode* node = get_inode(inum);
+    if (node == 0) {
+      continue;
+    }
+
+    if (is_head(inum) && !reachable[inum]) {
+      problem("inode %d is allocated but unreachable", inum);
+    } else if (!is_head(inum) && !chainReached[inum]) {
+      problem("indirect node %d is not reachable from any file", inum);
+    } else if (is_head(inum) && linkCounts[inum] > 0 && node->refs != linkCounts[inum] - 1) {
+      problem("inode %d has %d links recorded", inum, node->refs + 1);
+    }
+  }
+
+  // Pages are compared against the pointers as they are, before any repair
+  void* pbm = get_pages_bitmap();
+  int freePages = 0;
+  for (int pnum = 0; pnum < PAGE_COUNT; pnum++) {
+    int used = pnum < firstData || pageCounts[pnum] > 0;
+    freePages += !used;
+
+    if (used && !bitmap_get(pbm, pnum)) {
+      problem("page %d is in use but marked free", pnum);
+    } else if (!used && bitmap_get(pbm, pnum)) {
+      problem("page %d is marked in use but nothing points at it", pnum);
+    } else if (pnum >= firstData && used && page_refs(pnum) != pageCounts[pnum]) {
+      problem("page %d has %d references recorded", pnum, page_refs(pnum));
+    }
+  }
+
+  void* ibm = get_inode_bitmap();
+  int freeInodes = 0;
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    freeInodes += !bitmap_get(ibm, inum);
+  }
+
+  if (sb->free_pages != freePages) {
+    problem("superblock counts %d free pages, there are %d", sb->free_pages, freePages);
+  }
+  if (sb->free_inodes != freeInodes) {
+    problem("superblock counts %d free inodes, there are %d", sb->free_inodes, freeInodes);
+  }
+
+  printf("nufs-fsck: %d errors, %d of %d pages and %d of %d inodes in use\n", errors,
+         PAGE_COUNT - freePages, PAGE_COUNT, INODE_COUNT - freeInodes, INODE_COUNT);
+
+  if (errors == 0) {
+    pages_mark_clean();
+    return 0;
+  }
+
+  if (!repair) {
+    return 4;
+  }
+
+  // Cut bad chains and drop pointers to pages that can't exist
+  for (int tt = 0; tt < threadCount; tt++) {
+    for (int ii = 0; ii < threads[tt].cutCount; ii++) {
+      get_inode(threads[tt].cuts[ii])->iptr = 0;
+    }
+  }
+
+  for (int inum = 0; inum < INODE_COUNT; inum++) {
+    inode* node = get_inode(inum);
+    for (int ii = 0; node != 0 && ii < 5; ii++) {
+      if (node->ptrs[ii] != 0 && !is_valid_page(node->ptrs[ii])) {
+        node->ptrs[ii] = 0;
+      }
+    }
+  }
+
+  // Entries for missing inodes go, reachable files get their real link counts.
+  // Removing an entry can move the ones after it in its page, so go backwards.
+  for (int ee = edgeCount - 1; ee >= 0; ee--) {
+    if (!is_head(edges[ee].inum)) {
+      directory_remove(edges[ee].entry);
+    }
+  }
+
+  for (int inum = 1; inum < INODE_COUNT; inum++) {
+    if (reachable[inum] && linkCounts[inum] > 0) {
+      get_inode(inum)->refs = linkCounts[inum] - 1;
+    }
+  }
+
+  // Files cut short lose the part of their size the chain no longer holds. That
+  // doesn't apply to compressed files, whose size isn't measured in their pages.
+  for (int head = 0; head < INODE_COUNT; head++) {
+    if (!is_head(head) || is_folder(get_inode(head)->mode) ||
+        (get_inode(head)->flags & INODE_COMPRESSED)) {
+      continue;
+    }
+
+    inode* node = get_inode(head);
+    int capacity = 5 * PAGE_SIZE;
+    for (int inum = node->iptr; inum != 0; inum = get_inode(inum)->iptr) {
+      capacity += 5 * PAGE_SIZE;
+    }
+
+    node->size = min(node->size, capacity);
+  }
+
+  // Recount the page bitmap and refcounts from the pointers that are left,
+  // then free whatever nothing can reach
+  rebuild_begin();
+  rebuild_run(-1);
+
+  for (int inum = 1; inum < INODE_COUNT; inum++) {
+    if (get_inode(inum) == 0) {
+      continue;
+    }
+
+    if (!is_head(inum) && !chainReached[inum]) {
+      get_inode(inum)->iptr = 0;
+      free_inode(inum);
+    } else if (is_head(inum) && !reachable[inum]) {
+      free_inode(inum);
+    }
+  }
+
+  pages_mark_clean();
+  printf("nufs-fsck: repaired %d errors\n", errors);
+  return 1;
+}
@@ -0,0 +1,188 @@
+// nufs-mkfs: creates an empty image with a chosen geometry
+//
+// usage: nufs-mkfs [-s size] [-N inodes | -i bytes-per-inode] [-b block-size]
+//                  [-J journal-size] [-d dir-format] [-S stripe-size | -T fast-size]
+//                  image[,image...]
+//
+// Sizes take a K, M or G suffix. Without options this makes the same 1MB image
+// with 256 inodes that mounting a missing image does, but with variable-length
+// directory entries that allow names up to 255 bytes. -d fixed keeps the old
+// 64-byte entries.
+//
+// Given several comma-separated files, the image is striped over them in
+// chunks of -S bytes (256K by default), and has to be mounted with the same
+// files in the same order. The size is the total over all of them.
+//
+// -T makes a tiered image from two files instead: the first, fast one holds
+// fast-size bytes including all of the metadata, and the second holds the rest.
+// Pages are moved between them while mounted depending on how often they're used.
+//
+// Each snapshot taken under /.snapshots copies every inode and directory page of
+// the live tree, sharing only file data, so an image meant to keep n snapshots
+// needs about n + 1 times the inodes its files take.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "directory.h"
+#include "inode.h"
+#include "pages.h"
+#include "storage.h"
+
+static int64_t parse_size(const char* text) {
+  char* end;
+  int64_t value = strtoll(text, &end, 10);
+
+  if (*end == 'K' || *end == 'k') {
+    value <<= 10;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    value <<= 20;
+    end++;
+  } else if (*end == 'G' || *end == 'g') {
+    value <<= 30;
+    end++;
+  }
+
+  return *end == 0 && end != text ? value : -1;
+}
+
+static int usage(const char* name) {
+  fprintf(stderr, "usage: %s [-s size] [-N inodes | -i bytes-per-inode] [-b block-size]\n"
+                  "       [-J journal-size] [-d fixed|variable] [-S stripe-size | -T fast-size]\n"
+                  "       image[,image...]\n", name);
+  return 1;
+}
+
+int main(int argc, char* argv[]) {
+  int64_t size = 1 << 20;
+  int64_t inodes = 0;
+  int64_t bytesPerInode = 4096;
+  int64_t blockSize = 4096;
+  int64_t journal = 0;
+  int dirFormat = DIR_FORMAT_VARIABLE;
+  int64_t stripeSize = 256 << 10;
+  int64_t fastSize = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:N:i:b:J:d:S:T:")) != -1) {
+    if (opt == 's') {
+      size = parse_size(optarg);
+    } else if (opt == 'N') {
+      inodes = parse_size(optarg);
+    } else if (opt == 'i') {
+      bytesPerInode = parse_size(optarg);
+    } else if (opt == 'b') {
+      blockSize = parse_size(optarg);
+    } else if (opt == 'J') {
+      journal = parse_size(optarg);
+    } else if (opt == 'd' && strcmp(optarg, "fixed") == 0) {
+      dirFormat = DIR_FORMAT_FIXED;
+    } else if (opt == 'd' && strcmp(optarg, "variable") == 0) {
+      dirFormat = DIR_FORMAT_VARIABLE;
+    } else if (opt == 'S') {
+      stripeSize = parse_size(optarg);
+    } else if (opt == 'T') {
+      fastSize = parse_size(optarg);
+    } else {
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1 || size <= 0 || inodes < 0 || bytesPerInode <= 0 || blockSize <= 0 ||
+      stripeSize <= 0 || fastSize < 0) {
+    return usage(argv[0]);
+  }
+
+  if (blockSize < NUFS_MIN_PAGE_SIZE || blockSize > NUFS_MAX_PAGE_SIZE ||
+      (blockSize & (blockSize - 1)) != 0) {
+    fprintf(stderr, "nufs-mkfs: the block size must be a power of two from %d to %d\n",
+            NUFS_MIN_PAGE_SIZE, NUFS_MAX_PAGE_SIZE);
+    return 1;
+  }
+
+  if (journal != 0) {
+    fprintf(stderr, "nufs-mkfs: nufs doesn't have a journal, -J must be 0\n");
+    return 1;
+  }
+
+  if (inodes == 0) {
+    inodes = size / bytesPerInode;
+  }
+
+  // Page numbers are ints and page refcounts are 16 bits wide
+  int64_t pages = size / blockSize;
+  if (pages < 2 || pages > INT32_MAX || inodes < 2 || inodes > INT32_MAX / (int)sizeof(inode)) {
+    fprintf(stderr, "nufs-mkfs: %ld pages and %ld inodes is out of range\n", pages, inodes);
+    return 1;
+  }
+
+  int files = 1;
+  for (const char* cc = argv[optind]; *cc != 0; cc++) {
+    files += *cc == ',';
+  }
+
+  if (files > NUFS_MAX_STRIPES) {
+    fprintf(stderr, "nufs-mkfs: an image can be striped over at most %d files\n",
+            NUFS_MAX_STRIPES);
+    return 1;
+  }
+
+  if (fastSize != 0 && (files != 2 || fastSize % blockSize != 0 || fastSize >= size)) {
+    fprintf(stderr, "nufs-mkfs: a tiered image is a fast and a slow file, and the fast "
+                    "size must be a multiple of the block size below the total\n");
+    return 1;
+  }
+
+  // Each chunk is mapped on its own, and there's a limit on mappings per process
+  int striped = files > 1 && fastSize == 0;
+  if (striped && (stripeSize % blockSize != 0 || stripeSize / blockSize > INT32_MAX ||
+                  (pages * blockSize + stripeSize - 1) / stripeSize > NUFS_MAX_STRIPE_CHUNKS)) {
+    fprintf(stderr, "nufs-mkfs: the stripe size must be a multiple of the block size, "
+                    "and split the image into at most %d chunks\n", NUFS_MAX_STRIPE_CHUNKS);
+    return 1;
+  }
+
+  superblock geometry;
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.page_size = blockSize;
+  geometry.page_count = pages;
+  geometry.inode_count = inodes;
+  geometry.dir_format = dirFormat;
+  geometry.stripe_pages = stripeSize / blockSize;
+  geometry.tier_pages = fastSize / blockSize;
+
+  int rv = pages_format(argv[optind], &geometry);
+  if (rv == -ENOSPC) {
+    fprintf(stderr, "nufs-mkfs: the metadata for %ld inodes doesn't fit in %ld pages\n",
+            inodes, pages);
+    return 1;
+  } else if (rv == -EINVAL) {
+    fprintf(stderr, "nufs-mkfs: the fast file needs room for the metadata and the root "
+                    "directory\n");
+    return 1;
+  } else if (rv < 0) {
+    fprintf(stderr, "nufs-mkfs: %s: %s\n", argv[optind], strerror(-rv));
+    return 1;
+  }
+
+  // Mounting the new image sets up the bitmaps and the root directory
+  storage_init(argv[optind]);
+  pages_mark_clean();
+
+  superblock* sb = get_superblock();
+  printf("nufs-mkfs: %s: %d pages of %d bytes, %d inodes, data from page %d\n",
+         argv[optind], sb->page_count, sb->page_size, sb->inode_count, sb->first_data_page);
+  if (sb->tier_pages > 0) {
+    printf("nufs-mkfs: tiered, %d pages in the fast file and %d in the slow one\n",
+           sb->tier_pages, sb->page_count - sb->tier_pages);
+  } else if (sb->stripe_count > 1) {
+    printf("nufs-mkfs: striped over %d files in chunks of %d pages\n",
+           sb->stripe_count, sb->stripe_pages);
+  }
+  return 0;
+}
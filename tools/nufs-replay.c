@@ -0,0 +1,258 @@
+// nufs-replay: replays a trace recorded with -o trace=file against an image
+//
+// usage: nufs-replay [-j threads] [-t] trace image
+//
+// Each record is run through the storage API the way nufs.c would have run it,
+// with made-up data for writes. The image is changed, so replay against a copy
+// of the one the trace was recorded on. With -j the records are handed out in
+// order to several threads, which take turns on the storage lock like FUSE
+// worker threads. With -t each record waits until its original start time.
+//
+// Prints how many operations returned something different from the recording,
+// followed by the replay's latencies in the same JSON as /.nufs/stats.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pages.h"
+#include "stats.h"
+#include "storage.h"
+#include "trace.h"
+
+static trace_header* header;
+static trace_record* ring;
+static uint64_t first; // index of the oldest record still in the ring
+static uint64_t count;
+
+static int honorTiming = 0;
+static uint64_t replayStart;
+static uint64_t next = 0; // records are claimed in order by the threads
+
+static uint64_t replayed = 0;
+static uint64_t mismatched = 0;
+static uint64_t skipped = 0;
+
+static trace_record* get_record(uint64_t idx) {
+  return &ring[(first + idx) % header->capacity];
+}
+
+static int ignore_entry(const char* name, const struct stat* st, void* arg) {
+  return 0;
+}
+
+// Buffers big enough for the largest read or write in the trace
+typedef struct replay_buffers {
+  char* data;
+  storage_extent* extents;
+} replay_buffers;
+
+// Runs one record, returns 1 if it isn't something that can be replayed
+static int replay(trace_record* rec, replay_buffers* bufs, int* rv) {
+  const char* path = rec->path;
+  struct stat st;
+  struct statvfs vfs;
+
+  if (rec->op == STATS_OP_ACCESS) {
+    *rv = storage_access(path, rec->size);
+  } else if (rec->op == STATS_OP_GETATTR) {
+    *rv = storage_stat(path, &st);
+  } else if (rec->op == STATS_OP_STATFS) {
+    *rv = storage_statfs(&vfs);
+  } else if (rec->op == STATS_OP_READDIR) {
+    *rv = storage_readdir(path, ignore_entry, 0);
+  } else if (rec->op == STATS_OP_MKNOD) {
+    *rv = storage_mknod(path, rec->size);
+  } else if (rec->op == STATS_OP_MKDIR) {
+    *rv = storage_mkdir(path, rec->size);
+  } else if (rec->op == STATS_OP_UNLINK) {
+    *rv = storage_unlink(path);
+  } else if (rec->op == STATS_OP_LINK) {
+    *rv = storage_link(path, rec->path2);
+  } else if (rec->op == STATS_OP_SYMLINK) {
+    *rv = storage_symlink(rec->path2, path);
+  } else if (rec->op == STATS_OP_READLINK) {
+    *rv = storage_readlink(path, bufs->data, rec->size);
+  } else if (rec->op == STATS_OP_RMDIR) {
+    *rv = storage_rmdir(path);
+  } else if (rec->op == STATS_OP_RENAME) {
+    *rv = storage_rename(path, rec->path2, 0);
+  } else if (rec->op == STATS_OP_CHMOD) {
+    *rv = storage_chmod(path, rec->size);
+  } else if (rec->op == STATS_OP_TRUNCATE) {
+    *rv = storage_truncate(path, rec->offset);
+  } else if (rec->op == STATS_OP_OPEN) {
+    *rv = 0;
+  } else if (rec->op == STATS_OP_READ) {
+    *rv = storage_read(path, bufs->data, rec->size, rec->offset);
+  } else if (rec->op == STATS_OP_WRITE) {
+    *rv = storage_write(path, bufs->data, rec->size, rec->offset);
+  } else if (rec->op == STATS_OP_READ_BUF) {
+    *rv = storage_read_extents(path, rec->size, rec->offset, bufs->extents, 0);
+    if (*rv == -ENOTSUP) {
+      *rv = storage_read(path, bufs->data, rec->size, rec->offset);
+    }
+  } else if (rec->op == STATS_OP_WRITE_BUF) {
+    // FUSE would splice the data in, a pwrite per extent stands in for that
+    *rv = storage_write_extents(path, rec->size, rec->offset, bufs->extents);
+    size_t done = 0;
+    for (int ii = 0; ii < *rv; ii++) {
+      pwrite(bufs->extents[ii].fd, bufs->data, bufs->extents[ii].size, bufs->extents[ii].pos);
+      done += bufs->extents[ii].size;
+    }
+    *rv = *rv < 0 ? *rv : (int)done;
+  } else if (rec->op == STATS_OP_RELEASE) {
+    *rv = (rec->size & O_ACCMODE) != O_RDONLY ? storage_flush(path) : 0;
+  } else if (rec->op == STATS_OP_FSYNC) {
+    *rv = storage_fsync(path);
+  } else if (rec->op == STATS_OP_UTIMENS) {
+    struct timespec ts[2] = { { rec->offset, 0 }, { rec->size, 0 } };
+    *rv = storage_set_time(path, ts);
+  } else {
+    return 1;
+  }
+
+  return 0;
+}
+
+static void wait_until(uint64_t ns) {
+  uint64_t now = stats_begin() - replayStart;
+  if (ns > now) {
+    struct timespec delay = { (ns - now) / 1000000000, (ns - now) % 1000000000 };
+    nanosleep(&delay, 0);
+  }
+}
+
+static void* replay_thread(void* arg) {
+  size_t* largest = arg;
+  replay_buffers bufs;
+  bufs.data = calloc(*largest + 1, 1);
+  bufs.extents = malloc((*largest / PAGE_SIZE + 2) * sizeof(storage_extent));
+  memset(bufs.data, 'r', *largest);
+
+  uint64_t idx;
+  while ((idx = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < count) {
+    trace_record* rec = get_record(idx);
+    if (rec->flags & TRACE_TRUNCATED) {
+      __atomic_fetch_add(&skipped, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    if (honorTiming) {
+      wait_until(rec->start_ns - get_record(0)->start_ns);
+    }
+
+    int rv;
+    uint64_t start = stats_begin();
+    storage_lock();
+    int unknown = replay(rec, &bufs, &rv);
+    storage_unlock();
+
+    if (unknown) {
+      __atomic_fetch_add(&skipped, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    stats_end(rec->op, start);
+
+    __atomic_fetch_add(&replayed, 1, __ATOMIC_RELAXED);
+    if (rv != rec->rv) {
+      __atomic_fetch_add(&mismatched, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  free(bufs.data);
+  free(bufs.extents);
+  return 0;
+}
+
+static int usage(const char* name) {
+  fprintf(stderr, "usage: %s [-j threads] [-t] trace image\n", name);
+  return 1;
+}
+
+int main(int argc, char* argv[]) {
+  int threadCount = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:t")) != -1) {
+    if (opt == 'j') {
+      threadCount = atoi(optarg);
+    } else if (opt == 't') {
+      honorTiming = 1;
+    } else {
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 2 || threadCount < 1) {
+    return usage(argv[0]);
+  }
+
+  int fd = open(argv[optind], O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  header = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED || st.st_size < sizeof(trace_header) ||
+      header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+      header->record_size != sizeof(trace_record) ||
+      st.st_size < sizeof(trace_header) + (size_t)header->capacity * sizeof(trace_record)) {
+    fprintf(stderr, "nufs-replay: %s isn't a nufs trace\n", argv[optind]);
+    return 1;
+  }
+
+  ring = (trace_record*)(header + 1);
+  count = header->written < header->capacity ? header->written : header->capacity;
+  first = header->written - count;
+
+  storage_init(argv[optind + 1]);
+
+  size_t largest = PAGE_SIZE;
+  for (uint64_t ii = 0; ii < count; ii++) {
+    trace_record* rec = get_record(ii);
+    int isData = rec->op == STATS_OP_READ || rec->op == STATS_OP_WRITE ||
+                 rec->op == STATS_OP_READ_BUF || rec->op == STATS_OP_WRITE_BUF ||
+                 rec->op == STATS_OP_READLINK;
+    if (isData && rec->size > largest) {
+      largest = rec->size;
+    }
+  }
+
+  // Background threads run as they would under FUSE, and the image is left clean
+  storage_start();
+  replayStart = stats_begin();
+
+  pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+  for (int tt = 0; tt < threadCount; tt++) {
+    pthread_create(&threads[tt], 0, replay_thread, &largest);
+  }
+  for (int tt = 0; tt < threadCount; tt++) {
+    pthread_join(threads[tt], 0);
+  }
+
+  double seconds = (stats_begin() - replayStart) / 1e9;
+  storage_stop();
+
+  printf("nufs-replay: %lu operations in %.3fs, %lu returned differently, %lu skipped\n",
+         replayed, seconds, mismatched, skipped);
+
+  size_t size;
+  char* text = stats_render(STATS_JSON, &size);
+  fwrite(text, 1, size, stdout);
+  free(text);
+
+  return 0;
+}
@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static trace_header* header = 0;
+static trace_record* records = 0;
+static size_t mappedSize = 0;
+static uint64_t startTime = 0;
+
+int trace_open(const char* path, int capacity) {
+  int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd == -1) {
+    return -errno;
+  }
+
+  mappedSize = sizeof(trace_header) + (size_t)capacity * sizeof(trace_record);
+  if (ftruncate(fd, mappedSize) != 0) {
+    close(fd);
+    return -errno;
+  }
+
+  void* base = mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return -errno;
+  }
+
+  header = base;
+  header->magic = TRACE_MAGIC;
+  header->version = TRACE_VERSION;
+  header->record_size = sizeof(trace_record);
+  header->capacity = capacity;
+  header->written = 0;
+  records = (trace_record*)(header + 1);
+  startTime = stats_begin();
+  return 0;
+}
+
+// Copies a path into a record field, returning TRACE_TRUNCATED if it didn't fit
+static int copy_path(char* to, const char* from) {
+  if (from == 0) {
+    return 0;
+  }
+
+  size_t length = strlen(from);
+  if (length >= TRACE_PATH) {
+    memcpy(to, from, TRACE_PATH - 1);
+    return TRACE_TRUNCATED;
+  }
+  memcpy(to, from, length);
+  return 0;
+}
+
+void trace_op(stats_op op, uint64_t start, const char* path, const char* path2,
+              int64_t offset, uint64_t size, int rv) {
+  if (header == 0) {
+    return;
+  }
+
+  // Claiming a slot is the only shared write, so callers don't need the storage lock
+  uint64_t slot = __atomic_fetch_add(&header->written, 1, __ATOMIC_RELAXED);
+  trace_record* record = &records[slot % header->capacity];
+
+  memset(record, 0, sizeof(trace_record));
+  record->start_ns = start - startTime;
+  record->duration_ns = stats_begin() - start;
+  record->offset = offset;
+  record->size = size;
+  record->rv = rv;
+  record->op = op;
+  record->flags = copy_path(record->path, path) | copy_path(record->path2, path2);
+}
+
+void trace_close() {
+  if (header != 0) {
+    msync(header, mappedSize, MS_SYNC);
+    munmap(header, mappedSize);
+    header = 0;
+  }
+}
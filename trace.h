@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "stats.h"
+
+#define TRACE_MAGIC 0x4352544e // "NTRC"
+#define TRACE_VERSION 1
+#define TRACE_PATH 104 // longer paths are cut short and marked TRACE_TRUNCATED
+#define TRACE_DEFAULT_RECORDS (64 * 1024)
+
+#define TRACE_TRUNCATED 0x1 // a path didn't fit, the record can't be replayed
+
+// The file starts with this header, followed by capacity records used as a ring
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size; // sizeof(trace_record)
+    uint32_t capacity; // records in the ring
+    uint64_t written; // records ever written, the next goes at written % capacity
+} trace_header;
+
+// One FUSE callback. What offset and size hold depends on the operation: modes
+// and flags go in size, truncate's new size and utimens' atime in offset.
+typedef struct trace_record {
+    uint64_t start_ns; // when the call started, from the start of the trace
+    uint64_t duration_ns;
+    int64_t  offset;
+    uint64_t size;
+    int32_t  rv;
+    uint16_t op; // stats_op
+    uint16_t flags; // TRACE_* flags
+    char     path[TRACE_PATH];
+    char     path2[TRACE_PATH]; // the second path of link, symlink and rename
+} trace_record;
+
+/**
+ * @brief Starts recording operations to a file, replacing what it held.
+ * 
+ * @param path the trace file
+ * @param capacity the number of records kept, older ones are overwritten
+ * @return int 0 if successful, a negative errno if the file couldn't be set up
+ */
+int trace_open(const char* path, int capacity);
+
+/**
+ * @brief Appends a record if a trace is open. Safe to call from any thread.
+ * 
+ * @param op the operation
+ * @param start the operation's start time, from stats_begin
+ * @param path the path it was called on
+ * @param path2 its second path, or 0
+ * @param offset see trace_record
+ * @param size see trace_record
+ * @param rv what the operation returned
+ */
+void trace_op(stats_op op, uint64_t start, const char* path, const char* path2,
+              int64_t offset, uint64_t size, int rv);
+
+/**
+ * @brief Stops recording and closes the trace file.
+ */
+void trace_close();
+
+#endif
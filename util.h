@@ -6,6 +6,8 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "pages.h"
+
 static int streq(const char* aa, const char* bb) { return strcmp(aa, bb) == 0; }
 
 static int min(int x, int y) { return (x < y) ? x : y; }
@@ -15,8 +17,8 @@ static int max(int x, int y) { return (x > y) ? x : y; }
 static int clamp(int x, int v0, int v1) { return max(v0, min(x, v1)); }
 
 static int bytes_to_pages(int bytes) {
-  int quo = bytes / 4096;
-  int rem = bytes % 4096;
+  int quo = bytes / PAGE_SIZE;
+  int rem = bytes % PAGE_SIZE;
   if (rem == 0) {
     return quo;
   } else {